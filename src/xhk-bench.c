@@ -0,0 +1,223 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Engine microbenchmark: synthetic typing corpora are pushed through
+    engine_process(), and the cost reported per event.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xhk-engine.h"
+#include "xhk-layout.h"
+#include "xhk-mirror.h"
+
+#define CORPUS_EVENTS (1 << 20)
+#define ROUNDS 8
+
+typedef struct BenchEvent_s {
+    uint8_t keycode;
+    bool key_down;
+    bool repeat;
+} BenchEvent_t;
+
+static const uint8_t LeftKeys[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B,
+};
+
+static const uint8_t AllKeys[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M,
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Deterministic, so that every run measures the same corpus */
+static uint32_t seed;
+
+static uint32_t rnd(uint32_t n)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return seed % n;
+}
+
+static size_t tap(BenchEvent_t * corpus, size_t n, uint8_t keycode)
+{
+    corpus[n++] = (BenchEvent_t) { keycode, true, false };
+    corpus[n++] = (BenchEvent_t) { keycode, false, false };
+
+    return n;
+}
+
+/* Two handed typing: every key passes straight through */
+static size_t corpus_plain(BenchEvent_t * corpus, size_t max)
+{
+    size_t n = 0;
+
+    while (n + 4 <= max)
+        n = rnd(6) ? tap(corpus, n, AllKeys[rnd(ARRAY_SIZE(AllKeys))])
+            : tap(corpus, n, KEY_SPACE);
+
+    return n;
+}
+
+/*
+ * One handed typing: the right half is reached by holding space, which
+ * autorepeats while held, and words are separated by tapped spaces.
+ */
+static size_t corpus_halfkey(BenchEvent_t * corpus, size_t max)
+{
+    size_t n = 0;
+
+    while (n + 16 <= max) {
+        int r = rnd(8);
+
+        if (r == 0) {
+            n = tap(corpus, n, KEY_SPACE);
+        } else if (r < 3) {
+            corpus[n++] = (BenchEvent_t) { KEY_SPACE, true, false };
+            corpus[n++] = (BenchEvent_t) { KEY_SPACE, true, true };
+            for (int i = rnd(3); i >= 0; i--)
+                n = tap(corpus, n, LeftKeys[rnd(ARRAY_SIZE(LeftKeys))]);
+            corpus[n++] = (BenchEvent_t) { KEY_SPACE, false, false };
+        } else {
+            n = tap(corpus, n, LeftKeys[rnd(ARRAY_SIZE(LeftKeys))]);
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Fast typing: each key goes down before the last is released, and the
+ * space modifier is let go while mirrored keys are still held.
+ */
+static size_t corpus_rollover(BenchEvent_t * corpus, size_t max)
+{
+    size_t n = 0;
+    uint8_t held = 0;
+
+    while (n + 8 <= max) {
+        uint8_t keycode = LeftKeys[rnd(ARRAY_SIZE(LeftKeys))];
+
+        if (rnd(10) == 0) {
+            corpus[n++] = (BenchEvent_t) { KEY_SPACE, true, false };
+            corpus[n++] = (BenchEvent_t) { keycode, true, false };
+            corpus[n++] = (BenchEvent_t) { KEY_SPACE, false, false };
+            corpus[n++] = (BenchEvent_t) { keycode, false, false };
+            continue;
+        }
+
+        corpus[n++] = (BenchEvent_t) { keycode, true, false };
+        if (held)
+            corpus[n++] = (BenchEvent_t) { held, false, false };
+        held = keycode;
+    }
+
+    if (held)
+        corpus[n++] = (BenchEvent_t) { held, false, false };
+
+    return n;
+}
+
+static const struct {
+    const char * name;
+    size_t (*generate)(BenchEvent_t * corpus, size_t max);
+    bool mirror_mode;
+} Corpora[] = {
+    { "plain",    corpus_plain,    false },
+    { "halfkey",  corpus_halfkey,  false },
+    { "rollover", corpus_rollover, false },
+    { "mirror",   corpus_plain,    true },
+};
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv)
+{
+    const struct xhk_layout * layout = &xhk_layouts[0];
+    BenchEvent_t * corpus = malloc(CORPUS_EVENTS * sizeof(*corpus));
+
+    if (!corpus)
+        return 1;
+
+    if (argc > 1) {
+        for (layout = xhk_layouts; layout->name; layout++)
+            if (strcmp(layout->name, argv[1]) == 0)
+                break;
+
+        if (!layout->name) {
+            fprintf(stderr, "Unknown layout '%s'\n", argv[1]);
+            return 1;
+        }
+    }
+
+    printf("%-10s %10s %10s %10s\n", "corpus", "events", "actions", "ns/event");
+
+    for (size_t c = 0; c < ARRAY_SIZE(Corpora); c++) {
+        Action_t actions[ENGINE_MAX_ACTIONS];
+        uint64_t best = UINT64_MAX;
+        unsigned long emitted = 0;
+        size_t events;
+
+        seed = 2463534242U;
+        events = Corpora[c].generate(corpus, CORPUS_EVENTS);
+
+        for (int round = 0; round < ROUNDS; round++) {
+            EngineTable_t table;
+            Engine_t engine;
+            uint64_t start, elapsed;
+
+            engine_table_init(&table, layout->mirror, Corpora[c].mirror_mode);
+            engine_init(&engine, &table);
+            emitted = 0;
+
+            start = now();
+            for (size_t i = 0; i < events; i++)
+                emitted += engine_process(&engine, corpus[i].keycode, corpus[i].key_down,
+                                          corpus[i].repeat, i * 40, actions);
+            elapsed = now() - start;
+
+            if (elapsed < best)
+                best = elapsed;
+        }
+
+        printf("%-10s %10zu %10lu %10.2f\n", Corpora[c].name, events, emitted,
+               (double)best / events);
+    }
+
+    free(corpus);
+
+    return 0;
+}
@@ -0,0 +1,542 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Configuration file, reloaded whenever it changes.
+
+    A thread watches the file with inotify. When it changes, the thread
+    parses it into a new EngineTable_t, and publishes that with a single
+    atomic pointer store. The event thread picks the new table up on its
+    next key, so a reload never blocks it, and never needs the keyboard
+    to be floated again. A table that is replaced is freed once the event
+    thread has moved on from it.
+
+    File format, one statement per line, '#' starts a comment:
+
+	layout <name>		start from a built in layout's mirror table
+	row <key> <key> ...	keys left to right, mirrored about their centre
+	swap <key> <key>	exchange two keys
+	modifier <key>		the key which mirrors while held (SPCE)
+	layer <key>		another modifier, with a layer of its own:
+				row, swap and map change it from here on
+	map <key> <key>		the first key types the second
+	mirror <on|off>		mirror all keys
+	tap <ms|auto|off>	a quick roll off the modifier is a tap
+	devices <ids|pattern>	as -i, read only at startup
+
+    Keys are either X keycodes, or XKB key names such as AC01 or SPCE.
+
+    Tables are parsed in the keycodes of the standard pc105 keymap, and
+    translated onto the keycodes of the keyboard in use by key name, so
+    that a layout fits any keyboard. The translation changes with the
+    keymap, so both threads may publish, one at a time under Lock.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+
+#include "xhk.h"
+#include "xhk-config.h"
+#include "xhk-keynames.h"
+#include "xhk-layout.h"
+#include "xhk-trace.h"
+
+/*
+ * Every publish frees all the retired tables but the one the event thread
+ * is using, so no more than two are ever waiting.
+ */
+#define MAX_RETIRED 2
+
+/* From the command line and the control socket: the base of every configuration */
+static EngineTable_t Defaults;
+
+/* Written by the config thread, read by the event thread */
+static _Atomic(const EngineTable_t *) Active = &Defaults;
+/* Written by the event thread: the table it may be using right now */
+static _Atomic(const EngineTable_t *) InUse = &Defaults;
+/* The event thread's own copy of InUse */
+static const EngineTable_t * Current = &Defaults;
+
+/* Under Lock: tables replaced but not yet freed */
+static EngineTable_t * Retired[MAX_RETIRED];
+static int nRetired;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+/* Under Lock: the table in force before translation, and the translation */
+static EngineTable_t Source;
+static uint8_t Remap[256];
+static bool Remapped;
+
+static struct {
+    char * path;
+    char * devices;
+    char * watch;	/* the watched directory, and the file name in it */
+    bool watching;
+    pthread_t thread;
+    int fd;
+} Config = { .fd = -1 };
+
+void config_init(const uint8_t * mirror, bool mirror_mode)
+{
+    engine_table_init(&Defaults, mirror, mirror_mode);
+    Source = Defaults;
+}
+
+void config_tap(unsigned int threshold, bool adaptive)
+{
+    Defaults.tap_threshold = threshold;
+    Defaults.tap_adaptive = adaptive;
+    Source = Defaults;
+}
+
+const EngineTable_t * config_current(void)
+{
+    const EngineTable_t * table = atomic_load_explicit(&Active, memory_order_acquire);
+
+    /*
+     * A new table: announce it before using it, then check it was not
+     * replaced in between, in which case it may already be freed.
+     */
+    while (table != Current) {
+        atomic_store(&InUse, table);
+        Current = table;
+        table = atomic_load(&Active);
+    }
+
+    return table;
+}
+
+const char * config_devices(void)
+{
+    return Config.devices;
+}
+
+#define CONFIG_ERROR(line, ...) do {			\
+	ERROR("%s:%d: ", Config.path, line);		\
+	ERROR(__VA_ARGS__);				\
+	ERROR("\n");					\
+	errors++;					\
+} while (0)
+
+static int parse_keys(int line, char * args, int * keys)
+{
+    int errors = 0;
+    int n = 0;
+
+    for (char * tok = strtok(args, " \t"); tok && n < 256; tok = strtok(NULL, " \t")) {
+        keys[n] = xhk_parse_key(tok);
+        if (keys[n] < 0) {
+            CONFIG_ERROR(line, "unknown key '%s'", tok);
+            return -1;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/* Parse the file into a new table, or return NULL if it has any errors */
+static EngineTable_t * parse(char ** devices)
+{
+    EngineTable_t * table;
+    EngineLayer_t * layer;
+    char buf[1024];
+    int line = 0;
+    int errors = 0;
+    FILE * fp;
+
+    fp = fopen(Config.path, "r");
+    if (!fp) {
+        ERROR("Couldn't open configuration %s: %s\n", Config.path, strerror(errno));
+        return NULL;
+    }
+
+    table = malloc(sizeof(*table));
+    if (!table) {
+        fclose(fp);
+        return NULL;
+    }
+    pthread_mutex_lock(&Lock);
+    *table = Defaults;
+    pthread_mutex_unlock(&Lock);
+    layer = &table->layers[0];
+    *devices = NULL;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        char * args, * cmd;
+        char * comment = strchr(buf, '#');
+        int keys[256];
+        int n = 0;
+
+        line++;
+
+        if (comment)
+            *comment = '\0';
+
+        cmd = strtok(buf, " \t\r\n");
+        if (!cmd)
+            continue;
+        args = strtok(NULL, "\r\n");
+        if (!args)
+            args = "";
+        args += strspn(args, " \t");
+        for (char * end = args + strlen(args); end > args && strchr(" \t", end[-1]); )
+            *--end = '\0';
+
+        if (strcmp(cmd, "devices") == 0) {
+            free(*devices);
+            *devices = strdup(args);
+            continue;
+        }
+
+        if (strcmp(cmd, "layout") == 0) {
+            const struct xhk_layout * layout = find_layout(args);
+
+            if (layout)
+                memcpy(table->layers[0].map, layout->mirror, sizeof(table->layers[0].map));
+            else
+                CONFIG_ERROR(line, "unknown layout '%s'", args);
+            continue;
+        }
+
+        if (strcmp(cmd, "mirror") == 0) {
+            if (strcmp(args, "on") == 0)
+                table->mirror_mode = true;
+            else if (strcmp(args, "off") == 0)
+                table->mirror_mode = false;
+            else
+                CONFIG_ERROR(line, "mirror is either on or off");
+            continue;
+        }
+
+        if (strcmp(cmd, "tap") == 0) {
+            char * end;
+            long ms = strtol(args, &end, 10);
+
+            if (strcmp(args, "off") == 0) {
+                table->tap_threshold = 0;
+            } else if (strcmp(args, "auto") == 0) {
+                table->tap_threshold = ENGINE_TAP_DEFAULT;
+                table->tap_adaptive = true;
+            } else if (end != args && *end == '\0' && ms > 0 && ms < 1000) {
+                table->tap_threshold = ms;
+                table->tap_adaptive = false;
+            } else
+                CONFIG_ERROR(line, "tap is a time in ms, auto or off");
+            continue;
+        }
+
+        if (strcmp(cmd, "modifier") == 0) {
+            n = parse_keys(line, args, keys);
+            if (n == 1)
+                table->layers[0].modifier = keys[0];
+            else if (n >= 0)
+                CONFIG_ERROR(line, "modifier takes exactly one key");
+        } else if (strcmp(cmd, "layer") == 0) {
+            n = parse_keys(line, args, keys);
+            if (n == 1 && table->nlayers == ENGINE_MAX_LAYERS) {
+                CONFIG_ERROR(line, "no more than %d layers", ENGINE_MAX_LAYERS);
+            } else if (n == 1) {
+                layer = engine_table_layer(table, keys[0]);
+                if (!layer) {
+                    CONFIG_ERROR(line, "key %d is already a modifier", keys[0]);
+                    layer = &table->layers[0];
+                }
+            } else if (n >= 0)
+                CONFIG_ERROR(line, "layer takes exactly one key");
+        } else if (strcmp(cmd, "swap") == 0) {
+            n = parse_keys(line, args, keys);
+            if (n == 2) {
+                layer->map[keys[0]] = keys[1];
+                layer->map[keys[1]] = keys[0];
+            } else if (n >= 0)
+                CONFIG_ERROR(line, "swap takes exactly two keys");
+        } else if (strcmp(cmd, "map") == 0) {
+            n = parse_keys(line, args, keys);
+            if (n == 2)
+                layer->map[keys[0]] = keys[1];
+            else if (n >= 0)
+                CONFIG_ERROR(line, "map takes exactly two keys");
+        } else if (strcmp(cmd, "row") == 0) {
+            n = parse_keys(line, args, keys);
+            for (int i = 0; i < n; i++)
+                layer->map[keys[i]] = keys[n - 1 - i];
+        } else
+            CONFIG_ERROR(line, "unknown statement '%s'", cmd);
+
+        if (n < 0)
+            errors++;
+    }
+
+    fclose(fp);
+
+    if (errors) {
+        free(table);
+        free(*devices);
+        *devices = NULL;
+        return NULL;
+    }
+
+    return table;
+}
+
+static inline uint8_t remap(uint8_t keycode)
+{
+    return Remapped ? Remap[keycode] : keycode;
+}
+
+/* The table onto the keyboard's keycodes, leaving out keys it hasn't got */
+static void translate(EngineTable_t * table, const EngineTable_t * source)
+{
+    *table = *source;
+
+    for (int l = 0; l < source->nlayers && Remapped; l++) {
+        const EngineLayer_t * from = &source->layers[l];
+        EngineLayer_t * to = &table->layers[l];
+
+        for (int i = 0; i < 256; i++)
+            to->map[i] = i;
+
+        for (int i = 0; i < 256; i++)
+            if (from->map[i] != i && remap(i) && remap(from->map[i]))
+                to->map[remap(i)] = remap(from->map[i]);
+
+        to->modifier = remap(from->modifier) ? remap(from->modifier) : from->modifier;
+    }
+
+    if (Remapped)
+        table->cancel = remap(source->cancel) ? remap(source->cancel) : source->cancel;
+
+    /* Modifiers may have been moved, or configured */
+    engine_table_compile(table);
+}
+
+/*
+ * Publish a new table, translated from source, and free any old ones the
+ * event thread is done with. Called with Lock held.
+ */
+static void publish(const EngineTable_t * source)
+{
+    EngineTable_t * table;
+    const EngineTable_t * old;
+    const EngineTable_t * in_use;
+
+    table = malloc(sizeof(*table));
+    if (!table) {
+        ERROR("Out of memory for a new table\n");
+        return;
+    }
+
+    Source = *source;
+    translate(table, source);
+
+    old = atomic_exchange(&Active, table);
+
+    if (old != &Defaults)
+        Retired[nRetired++] = (EngineTable_t *)old;
+
+    in_use = atomic_load(&InUse);
+
+    for (int i = 0; i < nRetired; )
+        if (Retired[i] != in_use) {
+            free(Retired[i]);
+            Retired[i] = Retired[--nRetired];
+        } else
+            i++;
+}
+
+void config_remap(const uint8_t * remap)
+{
+    pthread_mutex_lock(&Lock);
+
+    Remapped = remap != NULL;
+    if (remap)
+        memcpy(Remap, remap, sizeof(Remap));
+
+    publish(&Source);
+
+    pthread_mutex_unlock(&Lock);
+}
+
+void config_enable(bool enabled)
+{
+    pthread_mutex_lock(&Lock);
+
+    Defaults.enabled = enabled;
+    Source.enabled = enabled;
+    publish(&Source);
+
+    pthread_mutex_unlock(&Lock);
+}
+
+void config_mirror_mode(bool mirror_mode)
+{
+    pthread_mutex_lock(&Lock);
+
+    Defaults.mirror_mode = mirror_mode;
+    Source.mirror_mode = mirror_mode;
+    publish(&Source);
+
+    pthread_mutex_unlock(&Lock);
+}
+
+void config_layout(const uint8_t * mirror)
+{
+    pthread_mutex_lock(&Lock);
+
+    memcpy(Defaults.layers[0].map, mirror, sizeof(Defaults.layers[0].map));
+    memcpy(Source.layers[0].map, mirror, sizeof(Source.layers[0].map));
+    publish(&Source);
+
+    pthread_mutex_unlock(&Lock);
+}
+
+static void reload(void)
+{
+    EngineTable_t * table;
+    char * devices;
+
+    table = parse(&devices);
+    if (!table) {
+        ERROR("Keeping the previous configuration\n");
+        return;
+    }
+
+    if ((devices == NULL) != (Config.devices == NULL)
+            || (devices && strcmp(devices, Config.devices)))
+        REPORT("Device selection changes take effect when xhk is restarted\n");
+    free(devices);
+
+    pthread_mutex_lock(&Lock);
+    publish(table);
+    pthread_mutex_unlock(&Lock);
+    free(table);
+
+    TRACE(RELOAD, 0, 0, 0, 0);
+    REPORT("Reloaded %s\n", Config.path);
+}
+
+static void * config_thread(void * data)
+{
+    char * name = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    trace_thread(TRACE_THREAD_CONFIG);
+
+    while ((len = read(Config.fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
+        bool changed = false;
+
+        for (char * p = buf; p < buf + len; ) {
+            struct inotify_event * event = (struct inotify_event *)p;
+
+            if (event->len && strcmp(event->name, name) == 0)
+                changed = true;
+
+            p += sizeof(*event) + event->len;
+        }
+
+        if (changed) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            reload();
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int config_open(const char * path)
+{
+    static char * name;
+    char * dir, * slash;
+    EngineTable_t * table;
+    sigset_t all, old;
+    int err;
+
+    Config.path = strdup(path);
+
+    table = parse(&Config.devices);
+    if (!table)
+        return -1;
+
+    pthread_mutex_lock(&Lock);
+    publish(table);
+    pthread_mutex_unlock(&Lock);
+    free(table);
+
+    INFO("Loaded configuration %s\n", path);
+
+    /* Editors often replace the file, so watch the directory for it */
+    dir = Config.watch = strdup(path);
+    slash = strrchr(dir, '/');
+    if (slash) {
+        name = slash + 1;
+        *slash = '\0';
+    } else {
+        name = dir;
+        dir = ".";
+    }
+
+    Config.fd = inotify_init1(IN_CLOEXEC);
+    if (Config.fd < 0 || inotify_add_watch(Config.fd, *dir ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ERROR("Couldn't watch %s for changes: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    /* Signals are for the event thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&Config.thread, NULL, config_thread, name);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        ERROR("Couldn't start the configuration thread: %s\n", strerror(err));
+        return 0;
+    }
+
+    Config.watching = true;
+
+    return 0;
+}
+
+void config_close(void)
+{
+    if (Config.watching) {
+        pthread_cancel(Config.thread);
+        pthread_join(Config.thread, NULL);
+        Config.watching = false;
+    }
+
+    if (Config.fd >= 0)
+        close(Config.fd);
+    Config.fd = -1;
+
+    free(Config.path);
+    free(Config.devices);
+    free(Config.watch);
+    Config.path = Config.devices = Config.watch = NULL;
+}
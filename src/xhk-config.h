@@ -0,0 +1,68 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Configuration file, reloaded whenever it changes.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_CONFIG_H_
+#define XHK_CONFIG_H_
+
+#include "xhk-engine.h"
+
+/* The table to use without a configuration file, or to build one upon */
+void config_init(const uint8_t * mirror, bool mirror_mode);
+/* Tap timing for the modifier, as EngineTable_t: threshold in ms, 0 for off */
+void config_tap(unsigned int threshold, bool adaptive);
+
+/*
+ * Load a configuration file, and watch it for changes from a thread of
+ * its own. Fails if the file cannot be read or parsed.
+ */
+int config_open(const char * path);
+void config_close(void);
+
+/*
+ * Tables are described in the keycodes of the standard pc105 keymap,
+ * which name the keys (xhk-keynames.h). Remap gives the keycode each of
+ * those has on the keyboard actually in use, or 0 for none. Every table
+ * from then on is translated through it, and the current one is
+ * republished at once. Called by the event thread when the keymap
+ * changes; NULL goes back to the standard keycodes.
+ */
+void config_remap(const uint8_t * remap);
+
+/*
+ * Changes made at run time, by the control socket. Each publishes a new
+ * table at once, and stays in force across reloads of the configuration
+ * file unless the file itself sets the same thing.
+ */
+void config_enable(bool enabled);
+void config_mirror_mode(bool mirror_mode);
+void config_layout(const uint8_t * mirror);
+
+/* The devices the configuration file selects, or NULL */
+const char * config_devices(void);
+
+/*
+ * The table currently in force. Only ever called by the event thread,
+ * and never blocks: a reload publishes a new table for it to pick up.
+ */
+const EngineTable_t * config_current(void);
+
+#endif /* XHK_CONFIG_H_ */
@@ -0,0 +1,288 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    A control socket, to change modes while running.
+
+    Commands, one per line:
+
+	enable | disable | toggle	mirror with the modifier, or pass
+					every key straight through
+	mirror on | off | toggle	mirror every key, as -m
+	layout NAME			switch to a built in layout, as -l
+	release				release every key xhk holds down
+	status				report the modes and keys held
+
+	echo toggle | socat - UNIX-CONNECT:/run/user/1000/xhk.control
+
+    The keyboards stay floated throughout: a change is a new engine table,
+    published as a configuration reload is, and picked up by the next key
+    event. A hold of the modifier already under way is finished as it
+    began, so no key is ever left mirrored or lost between two modes.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "xhk.h"
+#include "xhk-config.h"
+#include "xhk-control.h"
+#include "xhk-layout.h"
+#include "xhk-loop.h"
+#include "xhk-trace.h"
+
+#define CONTROL_MAX_CLIENTS 4
+#define CONTROL_LINE 256
+
+typedef struct ControlClient_s {
+    int fd;
+    LoopSource_t * source;
+    char buf[CONTROL_LINE];
+    size_t len;
+} ControlClient_t;
+
+static struct {
+    char * path;
+    int fd;
+    LoopSource_t * source;
+    XWindowsScreen_t * screen;
+    ControlClient_t clients[CONTROL_MAX_CLIENTS];
+} Control = { .fd = -1 };
+
+static int parse_switch(const char * arg, bool current)
+{
+    if (!arg || strcmp(arg, "toggle") == 0)
+        return !current;
+    if (strcmp(arg, "on") == 0)
+        return true;
+    if (strcmp(arg, "off") == 0)
+        return false;
+
+    return -1;
+}
+
+bool control_command(XWindowsScreen_t * screen, char * command, char * reply, size_t size)
+{
+    const EngineTable_t * table = config_current();
+    char * cmd = strtok(command, " \t\r\n");
+    char * arg = strtok(NULL, " \t\r\n");
+    int value;
+
+    if (!cmd) {
+        snprintf(reply, size, "error: no command");
+        return false;
+    }
+
+    if (strcmp(cmd, "enable") == 0 || strcmp(cmd, "disable") == 0 || strcmp(cmd, "toggle") == 0) {
+        value = cmd[0] == 't' ? !table->enabled : cmd[0] == 'e';
+        config_enable(value);
+        snprintf(reply, size, "ok %s", value ? "enabled" : "disabled");
+    } else if (strcmp(cmd, "mirror") == 0) {
+        value = parse_switch(arg, table->mirror_mode);
+        if (value < 0) {
+            snprintf(reply, size, "error: mirror is on, off or toggle");
+            return false;
+        }
+        config_mirror_mode(value);
+        snprintf(reply, size, "ok mirror %s", value ? "on" : "off");
+    } else if (strcmp(cmd, "layout") == 0) {
+        const struct xhk_layout * layout = arg ? find_layout(arg) : NULL;
+
+        if (!layout) {
+            snprintf(reply, size, "error: unknown layout '%s'", arg ? arg : "");
+            return false;
+        }
+        config_layout(layout->mirror);
+        snprintf(reply, size, "ok layout %s", layout->name);
+    } else if (strcmp(cmd, "release") == 0) {
+        snprintf(reply, size, "ok released %d", release_keys(screen));
+    } else if (strcmp(cmd, "status") == 0) {
+        int down = 0;
+
+        for (int i = 0; i < screen->nkeyboards; i++)
+            for (int keycode = 0; keycode < 256; keycode++)
+                down += screen->keyboards[i].engine.keystates[keycode] == KEYSTATE_DOWN;
+
+        snprintf(reply, size, "ok %s mirror %s keyboards %d down %d",
+                 table->enabled ? "enabled" : "disabled", table->mirror_mode ? "on" : "off",
+                 screen->nkeyboards, down);
+        return true;
+    } else {
+        snprintf(reply, size, "error: unknown command '%s'", cmd);
+        return false;
+    }
+
+    table = config_current();
+    TRACE(CONTROL, table->enabled, table->mirror_mode, 0, 0);
+    REPORT("Control: %s\n", reply + 3);
+
+    return true;
+}
+
+static void client_close(ControlClient_t * client)
+{
+    loop_remove(client->source);
+    close(client->fd);
+    *client = (ControlClient_t) { .fd = -1 };
+}
+
+static void client_read(void * data)
+{
+    ControlClient_t * client = data;
+    char reply[CONTROL_LINE + 64];
+    ssize_t len;
+    char * eol;
+
+    len = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len - 1);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0) {
+        client_close(client);
+        return;
+    }
+    client->len += len;
+    client->buf[client->len] = '\0';
+
+    while ((eol = strchr(client->buf, '\n'))) {
+        size_t used = eol + 1 - client->buf;
+
+        *eol = '\0';
+        control_command(Control.screen, client->buf, reply, sizeof(reply) - 1);
+        strcat(reply, "\n");
+
+        /* A client which doesn't read its replies loses them, rather than stall us */
+        if (write(client->fd, reply, strlen(reply)) < 0 && errno != EAGAIN) {
+            client_close(client);
+            return;
+        }
+
+        client->len -= used;
+        memmove(client->buf, client->buf + used, client->len + 1);
+    }
+
+    if (client->len == sizeof(client->buf) - 1) {
+        ERROR("Control command too long, disconnecting\n");
+        client_close(client);
+    }
+}
+
+static void control_accept(void * data)
+{
+    int fd;
+
+    while ((fd = accept4(Control.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        ControlClient_t * client = NULL;
+
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && !client; i++)
+            if (!Control.clients[i].source)
+                client = &Control.clients[i];
+
+        if (!client) {
+            ERROR("Too many control clients\n");
+            close(fd);
+            continue;
+        }
+
+        client->source = loop_add_fd(fd, client_read, NULL, client);
+        if (!client->source) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->len = 0;
+    }
+}
+
+int control_open(const char * path, XWindowsScreen_t * screen)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("Control socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    Control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (Control.fd < 0) {
+        ERROR("Couldn't create the control socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Left behind by an xhk which didn't exit cleanly */
+    if (unlink_socket(path)) {
+        ERROR("Won't replace %s with the control socket: %s\n", path, strerror(errno));
+        close(Control.fd);
+        Control.fd = -1;
+        return -1;
+    }
+
+    /* Only for the user xhk runs as */
+    mask = umask(077);
+    if (bind(Control.fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(Control.fd, 4)) {
+        ERROR("Couldn't listen on %s: %s\n", path, strerror(errno));
+        umask(mask);
+        close(Control.fd);
+        Control.fd = -1;
+        return -1;
+    }
+    umask(mask);
+
+    Control.path = strdup(path);
+    Control.screen = screen;
+
+    Control.source = loop_add_fd(Control.fd, control_accept, NULL, NULL);
+    if (!Control.source) {
+        control_close();
+        return -1;
+    }
+
+    INFO("Listening for control commands on %s\n", path);
+
+    return 0;
+}
+
+void control_close(void)
+{
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        if (Control.clients[i].source)
+            client_close(&Control.clients[i]);
+
+    loop_remove(Control.source);
+    Control.source = NULL;
+
+    if (Control.fd >= 0) {
+        close(Control.fd);
+        if (Control.path)
+            unlink_socket(Control.path);
+    }
+    Control.fd = -1;
+
+    free(Control.path);
+    Control.path = NULL;
+    Control.screen = NULL;
+}
@@ -0,0 +1,40 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    A control socket, to change modes while running.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef XHK_CONTROL_H_
+#define XHK_CONTROL_H_
+
+#include "xhk.h"
+
+/*
+ * Listen on a Unix socket at path for commands, one per line, each
+ * answered with a line starting "ok" or "error". Commands run on the
+ * event thread between key events, so each takes effect from the next.
+ */
+int control_open(const char * path, XWindowsScreen_t * screen);
+void control_close(void);
+
+/* Run one command, writing the reply into reply; false on an error */
+bool control_command(XWindowsScreen_t * screen, char * command, char * reply, size_t size);
+
+#endif /* XHK_CONTROL_H_ */
@@ -0,0 +1,202 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Dictionaries for predictive mode: building, checking and searching
+    the word trie.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xhk-dict.h"
+
+typedef struct Entry_s {
+    const char * word;
+    uint32_t frequency;
+} Entry_t;
+
+/* A node waiting for its children: the words under it, sharing depth letters */
+typedef struct Pending_s {
+    uint32_t node;
+    size_t first, end;
+    size_t depth;
+} Pending_t;
+
+static int compare_entries(const void * a, const void * b)
+{
+    return strcmp(((const Entry_t *)a)->word, ((const Entry_t *)b)->word);
+}
+
+void * dict_build(const char * const * words, const uint32_t * frequencies, size_t nwords, size_t * size)
+{
+    Entry_t * entries = malloc((nwords + 1) * sizeof(*entries));
+    size_t letters = 0, queued = 0, next = 0;
+    DictHeader_t * header;
+    DictNode_t * nodes;
+    Pending_t * queue;
+    uint32_t nnodes = 1;
+
+    if (!entries)
+        return NULL;
+
+    for (size_t i = 0; i < nwords; i++) {
+        entries[i] = (Entry_t) { words[i], frequencies[i] };
+        letters += strlen(words[i]);
+    }
+    qsort(entries, nwords, sizeof(*entries), compare_entries);
+
+    /* Never more nodes than letters, and the root */
+    header = calloc(1, sizeof(*header) + (letters + 1) * sizeof(*nodes));
+    queue = malloc((letters + 1) * sizeof(*queue));
+    if (!header || !queue) {
+        free(entries);
+        free(header);
+        free(queue);
+        return NULL;
+    }
+    nodes = (DictNode_t *)(header + 1);
+
+    nodes[0].last = 1;
+    queue[queued++] = (Pending_t) { 0, 0, nwords, 0 };
+
+    /* Breadth first, so that each node's children are made together */
+    while (next < queued) {
+        Pending_t p = queue[next++];
+        size_t i = p.first;
+        uint32_t first = nnodes;
+
+        /* The words which end here sort first; duplicates add up */
+        for (; i < p.end && entries[i].word[p.depth] == '\0'; i++) {
+            uint32_t frequency = nodes[p.node].frequency;
+
+            nodes[p.node].frequency = entries[i].frequency > UINT32_MAX - frequency
+                                      ? UINT32_MAX : frequency + entries[i].frequency;
+        }
+
+        while (i < p.end) {
+            char letter = entries[i].word[p.depth];
+            size_t j = i;
+
+            while (j < p.end && entries[j].word[p.depth] == letter)
+                j++;
+
+            nodes[nnodes] = (DictNode_t) { .letter = letter };
+            queue[queued++] = (Pending_t) { nnodes, i, j, p.depth + 1 };
+            nnodes++;
+            i = j;
+        }
+
+        if (nnodes > first) {
+            nodes[p.node].children = first;
+            nodes[nnodes - 1].last = 1;
+        }
+    }
+
+    memcpy(header->magic, DICT_MAGIC, sizeof(header->magic));
+    header->nodes = nnodes;
+    header->words = nwords;
+
+    *size = sizeof(*header) + nnodes * sizeof(*nodes);
+
+    free(entries);
+    free(queue);
+
+    return realloc(header, *size);
+}
+
+int dict_load(Dict_t * dict, const void * image, size_t size)
+{
+    const DictHeader_t * header = image;
+    const DictNode_t * nodes = (const DictNode_t *)(header + 1);
+
+    if (size < sizeof(*header) + sizeof(*nodes)
+            || memcmp(header->magic, DICT_MAGIC, sizeof(header->magic))
+            || header->nodes == 0
+            || (size - sizeof(*header)) / sizeof(*nodes) != header->nodes)
+        return -1;
+
+    /* Each run of children ends within the file, as the last node is marked */
+    if (!nodes[header->nodes - 1].last)
+        return -1;
+
+    for (uint32_t i = 0; i < header->nodes; i++)
+        if (nodes[i].children >= header->nodes)
+            return -1;
+
+    dict->header = header;
+    dict->nodes = nodes;
+
+    return 0;
+}
+
+typedef struct Search_s {
+    const DictNode_t * nodes;
+    const DictKey_t * keys;
+    int nkeys;
+    uint32_t best;
+    int32_t choice;
+} Search_t;
+
+static void search(Search_t * s, const DictNode_t * node, int depth, int32_t choice)
+{
+    const DictKey_t * key;
+
+    if (depth == s->nkeys) {
+        if (node->frequency > s->best) {
+            s->best = node->frequency;
+            s->choice = choice;
+        }
+        return;
+    }
+
+    if (!node->children)
+        return;
+
+    key = &s->keys[depth];
+
+    /* The typed letter first, so that it wins a tie */
+    for (int c = 0; c < key->choices; c++)
+        for (const DictNode_t * child = &s->nodes[node->children]; ; child++) {
+            if (child->letter == key->letters[c]) {
+                search(s, child, depth + 1, choice | (c << depth));
+                break;
+            }
+            if (child->last || child->letter > key->letters[c])
+                break;
+        }
+}
+
+int32_t dict_best(const Dict_t * dict, const DictKey_t * keys, int nkeys)
+{
+    Search_t s = {
+        .nodes = dict->nodes,
+        .keys = keys,
+        .nkeys = nkeys,
+        .best = 0,
+        .choice = -1,
+    };
+
+    if (nkeys > DICT_MAX_WORD)
+        return -1;
+
+    search(&s, &dict->nodes[0], 0, 0);
+
+    return s.choice;
+}
@@ -0,0 +1,84 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Dictionaries for predictive mode: a word trie, compiled ahead of time
+    by xhk-dictc into a file which is used exactly as it is mapped.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef XHK_DICT_H_
+#define XHK_DICT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DICT_MAGIC "XHKDICT1"
+
+/* The longest word looked up: longer ones are left as they are typed */
+#define DICT_MAX_WORD 24
+
+/*
+ * On disk, in the byte order of the machine which compiled it: a header,
+ * then the nodes in breadth first order from the root at index 0. The
+ * children of a node are consecutive, in letter order, and the last of
+ * them is marked, so a lookup only ever reads forward from one index.
+ */
+typedef struct DictHeader_s {
+    char magic[8];
+    uint32_t nodes;
+    uint32_t words;
+} DictHeader_t;
+
+typedef struct DictNode_s {
+    uint32_t children;	/* index of the first child, 0 for none */
+    uint32_t frequency;	/* of the word which ends here, 0 for none */
+    uint8_t letter;	/* 'a' to 'z' */
+    uint8_t last;	/* the last child of its parent */
+    uint16_t reserved;
+} DictNode_t;
+
+typedef struct Dict_s {
+    const DictHeader_t * header;
+    const DictNode_t * nodes;
+} Dict_t;
+
+/* Each typed key: the letters it may stand for, one or two */
+typedef struct DictKey_s {
+    char letters[2];
+    uint8_t choices;
+} DictKey_t;
+
+/*
+ * Build a dictionary image from words of 'a' to 'z' in any order, with
+ * their frequencies. Returns a malloc()ed image, and its size in size.
+ */
+void * dict_build(const char * const * words, const uint32_t * frequencies, size_t nwords, size_t * size);
+
+/* Check an image is whole and every index in it is in range */
+int dict_load(Dict_t * dict, const void * image, size_t size);
+
+/*
+ * The most frequent word with one of each key's letters in turn, as the
+ * choice of letter for each key, bit i for key i. Negative when there is
+ * no such word. Allocates nothing.
+ */
+int32_t dict_best(const Dict_t * dict, const DictKey_t * keys, int nkeys);
+
+#endif /* XHK_DICT_H_ */
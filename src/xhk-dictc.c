@@ -0,0 +1,116 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Dictionary compiler: turns a word list into the trie predictive mode
+    maps straight into memory, so that xhk never parses one.
+
+	xhk-dictc WORDS DICT
+
+    WORDS holds a word per line, optionally followed by how often it
+    occurs. Without counts, the most frequent words are taken to come
+    first. Words with anything but the letters a to z in them, in either
+    case, are skipped.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "xhk-dict.h"
+
+int main(int argc, char ** argv)
+{
+    char ** words = NULL;
+    uint32_t * frequencies = NULL;
+    size_t nwords = 0, allocated = 0, skipped = 0, size;
+    char * line = NULL;
+    size_t length = 0;
+    void * image;
+    FILE * in, * out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s WORDS DICT\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "r");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    while (getline(&line, &length, in) >= 0) {
+        char * word = strtok(line, " \t\r\n");
+        char * count = strtok(NULL, " \t\r\n");
+        bool letters = word != NULL;
+
+        if (!word || word[0] == '#')
+            continue;
+
+        for (char * c = word; *c && letters; c++) {
+            *c = tolower((unsigned char)*c);
+            letters = *c >= 'a' && *c <= 'z';
+        }
+
+        if (!letters || strlen(word) > DICT_MAX_WORD) {
+            skipped++;
+            continue;
+        }
+
+        if (nwords == allocated) {
+            allocated = allocated ? allocated * 2 : 4096;
+            words = realloc(words, allocated * sizeof(*words));
+            frequencies = realloc(frequencies, allocated * sizeof(*frequencies));
+            if (!words || !frequencies) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+
+        words[nwords] = strdup(word);
+        /* By rank: the first word is the most frequent */
+        frequencies[nwords] = count ? strtoul(count, NULL, 10) : UINT32_MAX - nwords;
+        nwords++;
+    }
+    fclose(in);
+    free(line);
+
+    image = dict_build((const char * const *)words, frequencies, nwords, &size);
+    if (!image) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    out = fopen(argv[2], "wb");
+    if (!out || fwrite(image, size, 1, out) != 1 || fclose(out)) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    printf("%zu words, %u nodes, %zu bytes", nwords, ((DictHeader_t *)image)->nodes, size);
+    if (skipped)
+        printf(", %zu lines skipped", skipped);
+    printf("\n");
+
+    return 0;
+}
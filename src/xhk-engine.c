@@ -0,0 +1,487 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    The half keyboard engine: the SPACE state machine and mirroring,
+    free of any display or device I/O.
+
+    Every modifier, SPACE or any other, switches on a layer of its own
+    and runs the same state machine. Each event is classified against
+    the layer it concerns, and the state machine is a table of what that
+    class of event does in each state: one lookup, rather than a branch
+    for each case.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+
+#include "xhk-engine.h"
+
+// KeyCode mappings to Layout nomenclatures
+#include "xhk-layout.h"
+
+static const char * SpaceStateNames[] = {
+    "Start",
+    "Pressed",
+    "Modified",
+    "Tapped",
+};
+
+const char * engine_state_name(int state)
+{
+    return SpaceStateNames[state];
+}
+
+/* What an event is, to the layer it concerns */
+enum engine_class {
+    CLASS_MODIFIER,	/* the layer's own modifier */
+    CLASS_MAPPED,	/* a key the layer changes */
+    CLASS_QUICK,	/* the same, pressed within the tap threshold */
+    CLASS_CANCEL,	/* the cancel key */
+    CLASS_OTHER,	/* anything else */
+    ENGINE_CLASSES,
+};
+
+enum engine_action {
+    ACTION_DISCARD,	/* inject nothing */
+    ACTION_PRESS,	/* nothing yet: the modifier is down */
+    ACTION_TAP,		/* the modifier was typed, not held */
+    ACTION_HOLD,	/* the modifier was held, and is done */
+    ACTION_KEY,		/* the key as it is */
+    ACTION_MAPPED,	/* the key as the layer maps it */
+    ACTION_TAP_KEY,	/* a tap of the modifier, then the key as it is */
+    ACTION_RELEASE,	/* up, whatever went down for the key */
+};
+
+typedef struct Transition_s {
+    uint8_t next;
+    uint8_t action;
+} Transition_t;
+
+#define T(next, action) { SPACE_STATE_##next, ACTION_##action }
+
+/*
+ * SPACE State Table, by state, class, and then up or down
+ *
+ * 			START		PRESSED		MODIFIED	TAPPED
+ *
+ * ModifierDown		Press		Discarded	Discarded	Discarded
+ * 			-> Pressed	-> Pressed	-> Modified	-> Tapped
+ *
+ * ModifierUp		Discarded	InjectSpace	Held		Discarded
+ * 			-> Start	-> Start	-> Start	-> Start
+ *
+ * MappedKey		InjectKey	MirrorKey	MirrorKey	InjectKey
+ * 			-> Start	-> Modified	-> Modified	-> Tapped
+ *
+ * QuickMappedKey			InjectSpace,Key
+ * 					-> Tapped
+ *
+ * Cancel		InjectKey	Discarded	Discarded	InjectKey
+ * 			-> Start	-> Modified	-> Modified	-> Tapped
+ *
+ * OtherKey		InjectKey	InjectKey	InjectKey	InjectKey
+ * 			-> Start	-> Pressed	-> Modified	-> Tapped
+ *
+ * A QuickMappedKey is the first mapped key pressed less than the tap
+ * threshold after the modifier, when tap timing is on. Releasing any key
+ * but the modifier changes no state, and releases whatever was injected
+ * when it went down.
+ */
+static const Transition_t Transitions[SPACE_STATES][ENGINE_CLASSES][2] = {
+    [SPACE_STATE_START] = {
+        [CLASS_MODIFIER] = { T(START, DISCARD),    T(PRESSED, PRESS) },
+        [CLASS_MAPPED]   = { T(START, RELEASE),    T(START, KEY) },
+        [CLASS_QUICK]    = { T(START, RELEASE),    T(START, KEY) },
+        [CLASS_CANCEL]   = { T(START, RELEASE),    T(START, KEY) },
+        [CLASS_OTHER]    = { T(START, RELEASE),    T(START, KEY) },
+    },
+    [SPACE_STATE_PRESSED] = {
+        [CLASS_MODIFIER] = { T(START, TAP),        T(PRESSED, DISCARD) },
+        [CLASS_MAPPED]   = { T(PRESSED, RELEASE),  T(MODIFIED, MAPPED) },
+        [CLASS_QUICK]    = { T(PRESSED, RELEASE),  T(TAPPED, TAP_KEY) },
+        [CLASS_CANCEL]   = { T(PRESSED, RELEASE),  T(MODIFIED, DISCARD) },
+        [CLASS_OTHER]    = { T(PRESSED, RELEASE),  T(PRESSED, KEY) },
+    },
+    [SPACE_STATE_MODIFIED] = {
+        [CLASS_MODIFIER] = { T(START, HOLD),       T(MODIFIED, DISCARD) },
+        [CLASS_MAPPED]   = { T(MODIFIED, RELEASE), T(MODIFIED, MAPPED) },
+        [CLASS_QUICK]    = { T(MODIFIED, RELEASE), T(MODIFIED, MAPPED) },
+        [CLASS_CANCEL]   = { T(MODIFIED, RELEASE), T(MODIFIED, DISCARD) },
+        [CLASS_OTHER]    = { T(MODIFIED, RELEASE), T(MODIFIED, KEY) },
+    },
+    [SPACE_STATE_TAPPED] = {
+        [CLASS_MODIFIER] = { T(START, DISCARD),    T(TAPPED, DISCARD) },
+        [CLASS_MAPPED]   = { T(TAPPED, RELEASE),   T(TAPPED, KEY) },
+        [CLASS_QUICK]    = { T(TAPPED, RELEASE),   T(TAPPED, KEY) },
+        [CLASS_CANCEL]   = { T(TAPPED, RELEASE),   T(TAPPED, KEY) },
+        [CLASS_OTHER]    = { T(TAPPED, RELEASE),   T(TAPPED, KEY) },
+    },
+};
+
+#undef T
+
+void engine_table_init(EngineTable_t * table, const uint8_t * mirror, bool mirror_mode)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->nlayers = 1;
+    table->layers[0].modifier = KEY_SPACE;
+    memcpy(table->layers[0].map, mirror, sizeof(table->layers[0].map));
+    table->cancel = KEY_ESC;
+    table->enabled = true;
+    table->mirror_mode = mirror_mode;
+    table->tap_threshold = 0;
+    table->tap_adaptive = false;
+
+    engine_table_compile(table);
+}
+
+EngineLayer_t * engine_table_layer(EngineTable_t * table, uint8_t modifier)
+{
+    EngineLayer_t * layer;
+
+    if (table->nlayers == ENGINE_MAX_LAYERS)
+        return NULL;
+
+    for (int i = 0; i < table->nlayers; i++)
+        if (table->layers[i].modifier == modifier)
+            return NULL;
+
+    layer = &table->layers[table->nlayers++];
+    layer->modifier = modifier;
+    for (int i = 0; i < 256; i++)
+        layer->map[i] = i;
+
+    engine_table_compile(table);
+
+    return layer;
+}
+
+void engine_table_compile(EngineTable_t * table)
+{
+    memset(table->layer_of, 0, sizeof(table->layer_of));
+
+    /* Backwards, so that the first layer wins a modifier given twice */
+    for (int i = table->nlayers - 1; i >= 0; i--)
+        table->layer_of[table->layers[i].modifier] = i + 1;
+}
+
+void engine_init(Engine_t * engine, const EngineTable_t * table)
+{
+    memset(engine, 0, sizeof(*engine));
+
+    engine->table = table;
+    for (int i = 0; i < ENGINE_MAX_LAYERS; i++)
+        engine->layers[i].space = SPACE_STATE_START;
+}
+
+unsigned int engine_tap_threshold(const Engine_t * engine)
+{
+    const EngineTable_t * table = engine->table;
+
+    if (!table->tap_threshold)
+        return 0;
+
+    if (table->tap_adaptive && engine->timing.threshold)
+        return engine->timing.threshold;
+
+    return table->tap_threshold;
+}
+
+unsigned int engine_layer_states(const Engine_t * engine)
+{
+    unsigned int states = 0;
+
+    for (int i = 0; i < ENGINE_MAX_LAYERS; i++)
+        states |= engine->layers[i].space << (2 * i);
+
+    return states;
+}
+
+/*
+ * Place the threshold where it misclassifies the fewest of the holds seen
+ * so far, in the middle of the best range: every roll at or above it
+ * would be taken for a chord, and every chord below it for a roll.
+ */
+static void learn_threshold(EngineTiming_t * timing)
+{
+    unsigned int cost = timing->nrolls, best = cost;
+    int first = 0, last = 0;
+
+    for (int b = 0; b < ENGINE_TAP_BUCKETS; b++) {
+        cost = cost - timing->rolls[b] + timing->chords[b];
+
+        if (cost < best) {
+            best = cost;
+            first = last = b + 1;
+        } else if (cost == best && last == b)
+            last = b + 1;
+    }
+
+    timing->threshold = (first + last) * ENGINE_TAP_BUCKET / 2;
+    if (timing->threshold < ENGINE_TAP_BUCKET)
+        timing->threshold = ENGINE_TAP_BUCKET;
+}
+
+/* The hold overlapping its lead_key has resolved, one way or the other */
+static void record_lead(Engine_t * engine, EngineHold_t * hold, bool roll)
+{
+    EngineTiming_t * timing = &engine->timing;
+    uint32_t bucket = hold->lead / ENGINE_TAP_BUCKET;
+
+    hold->lead_key = 0;
+
+    if (!engine->table->tap_adaptive)
+        return;
+
+    if (bucket >= ENGINE_TAP_BUCKETS)
+        bucket = ENGINE_TAP_BUCKETS - 1;
+
+    if (roll) {
+        timing->rolls[bucket]++;
+        timing->nrolls++;
+    } else {
+        timing->chords[bucket]++;
+        timing->nchords++;
+    }
+
+    /* A running window: halve everything, so recent typing counts most */
+    if (timing->nrolls + timing->nchords >= ENGINE_TAP_WINDOW) {
+        timing->nrolls = timing->nchords = 0;
+        for (int b = 0; b < ENGINE_TAP_BUCKETS; b++) {
+            timing->rolls[b] /= 2;
+            timing->chords[b] /= 2;
+            timing->nrolls += timing->rolls[b];
+            timing->nchords += timing->chords[b];
+        }
+    }
+
+    if (timing->nrolls >= ENGINE_TAP_SAMPLES && timing->nchords >= ENGINE_TAP_SAMPLES)
+        learn_threshold(timing);
+}
+
+int engine_release(Engine_t * engine, Action_t actions[256])
+{
+    int n = 0;
+
+    for (int keycode = 0; keycode < 256; keycode++)
+        if (engine->keystates[keycode] == KEYSTATE_DOWN) {
+            actions[n++] = (Action_t) { .keycode = keycode, .key_down = false };
+            engine->keystates[keycode] = KEYSTATE_UP;
+        }
+
+    for (int i = 0; i < ENGINE_MAX_LAYERS; i++) {
+        engine->layers[i].space = SPACE_STATE_START;
+        engine->layers[i].lead_key = 0;
+    }
+    engine->held = 0;
+    memset(engine->pressed, 0, sizeof(engine->pressed));
+    memset(engine->pressed_layer, 0, sizeof(engine->pressed_layer));
+
+    return n;
+}
+
+static inline bool held(const EngineHold_t * hold)
+{
+    return hold->space == SPACE_STATE_PRESSED || hold->space == SPACE_STATE_MODIFIED;
+}
+
+static inline void emit(Engine_t * engine, Action_t * actions, int * n, int keycode, bool key_down)
+{
+    actions[(*n)++] = (Action_t) {
+        .keycode = keycode,
+        .key_down = key_down,
+    };
+
+    /* Record this action in our state table */
+    engine->keystates[(uint8_t)keycode] = key_down;
+}
+
+/*
+ * The layer a key pressed now belongs to: the last held layer to change
+ * it, or for the cancel key, the last held layer of all. -1 for none.
+ */
+static int find_layer(const Engine_t * engine, int keycode, enum engine_class * class)
+{
+    const EngineTable_t * table = engine->table;
+    int found = -1, last = -1;
+
+    for (int i = 0; engine->held >> i; i++) {
+        const EngineHold_t * hold = &engine->layers[i];
+
+        if (!(engine->held & (1 << i)))
+            continue;
+
+        if (table->layers[i].map[keycode] != keycode
+                && (found < 0 || hold->order > engine->layers[found].order))
+            found = i;
+        if (last < 0 || hold->order > engine->layers[last].order)
+            last = i;
+    }
+
+    if (found >= 0) {
+        *class = CLASS_MAPPED;
+        return found;
+    }
+
+    if (keycode == table->cancel && last >= 0) {
+        *class = CLASS_CANCEL;
+        return last;
+    }
+
+    *class = CLASS_OTHER;
+    return -1;
+}
+
+int engine_process(Engine_t * engine, int keycode, bool key_down, bool repeat,
+                   uint32_t time, Action_t actions[ENGINE_MAX_ACTIONS])
+{
+    const EngineTable_t * table = engine->table;
+    enum engine_class class = CLASS_OTHER;
+    EngineHold_t * hold = NULL;
+    const Transition_t * t;
+    bool active = table->enabled;
+    int layer = -1;
+    int physical;
+    int n = 0;
+
+    keycode = physical = (uint8_t)keycode;
+
+    /*
+     * Ignore all key repeats. A modifier never repeats, and any other key
+     * we injected a press for is repeated by the server, or the kernel, on
+     * the keyboard we inject to: injecting the repeats as well would only
+     * double them up.
+     */
+    if (repeat)
+        return 0;
+
+    /* Disabled, the engine still runs until every modifier is released */
+    for (int i = 0; i < table->nlayers && !active; i++)
+        active = engine->layers[i].space != SPACE_STATE_START;
+
+    /*
+     * MirrorMode mirrors all keys before the state machine operates. What
+     * went down is still kept by the physical key, so that its release
+     * follows it even if the mode has changed meanwhile.
+     */
+    if (active && table->mirror_mode)
+        keycode = table->layers[0].map[keycode];
+
+    /* A modifier pressed while disabled is released as it was pressed */
+    if (active && table->layer_of[keycode] && (key_down || !engine->pressed[physical])) {
+        layer = table->layer_of[keycode] - 1;
+        class = CLASS_MODIFIER;
+    } else if (active && key_down && engine->held) {
+        layer = find_layer(engine, keycode, &class);
+    }
+
+    if (layer >= 0) {
+        hold = &engine->layers[layer];
+        t = &Transitions[hold->space][class][key_down];
+    } else {
+        t = &Transitions[SPACE_STATE_START][CLASS_OTHER][key_down];
+    }
+
+    /* The first mapped key of a hold: rolled quickly into, or chorded? */
+    if (class == CLASS_MAPPED && hold->space == SPACE_STATE_PRESSED && table->tap_threshold) {
+        hold->lead_key = keycode;
+        hold->lead = time - hold->modifier_time;
+
+        if (hold->lead < engine_tap_threshold(engine)) {
+            class = CLASS_QUICK;
+            t = &Transitions[hold->space][class][key_down];
+        }
+    }
+
+    if (!key_down) {
+        /* Modifier released while still holding the first mapped key: a roll */
+        if (class == CLASS_MODIFIER && hold->lead_key)
+            record_lead(engine, hold, true);
+
+        /* Released before the modifier: a chord */
+        for (int i = 0; i < table->nlayers; i++)
+            if (engine->layers[i].lead_key == keycode && class != CLASS_MODIFIER)
+                record_lead(engine, &engine->layers[i], false);
+    }
+
+    if (hold) {
+        hold->space = t->next;
+        if (held(hold))
+            engine->held |= 1 << layer;
+        else
+            engine->held &= ~(1 << layer);
+    }
+
+    switch (t->action) {
+    case ACTION_DISCARD:
+        break;
+    case ACTION_PRESS:
+        hold->modifier_time = time;
+        hold->order = ++engine->presses;
+        hold->lead_key = 0;
+        break;
+    case ACTION_TAP:
+        /* We discarded the original modifier down event, so provide one now */
+        engine->stats.taps++;
+        emit(engine, actions, &n, keycode, true);
+        emit(engine, actions, &n, keycode, false);
+        break;
+    case ACTION_HOLD:
+        engine->stats.holds++;
+        break;
+    case ACTION_TAP_KEY:
+        /* Rolled quickly off the modifier into the next key: type it now */
+        engine->stats.taps++;
+        emit(engine, actions, &n, table->layers[layer].modifier, true);
+        emit(engine, actions, &n, table->layers[layer].modifier, false);
+        /* Fall Through */
+    case ACTION_KEY:
+        engine->stats.passthrough++;
+        engine->pressed[physical] = keycode;
+        engine->pressed_layer[physical] = 0;
+        emit(engine, actions, &n, keycode, true);
+        break;
+    case ACTION_MAPPED:
+        engine->stats.mirrored++;
+        engine->pressed[physical] = table->layers[layer].map[keycode];
+        engine->pressed_layer[physical] = layer + 1;
+        emit(engine, actions, &n, engine->pressed[physical], true);
+        actions[n - 1].mapped = true;
+        break;
+    case ACTION_RELEASE: {
+        /* Up goes to what went down, even if the layer has changed since */
+        int up = engine->pressed[physical] ? engine->pressed[physical] : keycode;
+        int by = engine->pressed_layer[physical];
+
+        /* Nothing went down for it, as for the cancel key under a layer */
+        if (!engine->pressed[physical] && engine->keystates[keycode] != KEYSTATE_DOWN)
+            break;
+
+        if (by && !held(&engine->layers[by - 1]))
+            engine->stats.inversions++;
+
+        engine->pressed[physical] = 0;
+        engine->pressed_layer[physical] = 0;
+        emit(engine, actions, &n, up, false);
+        break;
+    }
+    }
+
+    return n;
+}
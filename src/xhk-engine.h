@@ -0,0 +1,178 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    The half keyboard engine: the SPACE state machine and mirroring,
+    free of any display or device I/O.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_ENGINE_H_
+#define XHK_ENGINE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SPACE_STATE_START    0
+#define SPACE_STATE_PRESSED  1
+#define SPACE_STATE_MODIFIED 2
+#define SPACE_STATE_TAPPED   3	/* emitted as a tap, waiting for release */
+#define SPACE_STATES         4
+
+/* KeyStates == key_down / is_pressed */
+#define KEYSTATE_DOWN 1
+#define KEYSTATE_UP   0
+
+/* No single input event ever produces more output than this */
+#define ENGINE_MAX_ACTIONS 4
+
+/* Modifiers, each switching on a layer of its own while held */
+#define ENGINE_MAX_LAYERS 4
+
+/* Tap timing, in milliseconds */
+#define ENGINE_TAP_DEFAULT  60	/* threshold until one is learned */
+#define ENGINE_TAP_BUCKET   5
+#define ENGINE_TAP_BUCKETS  64	/* leads beyond land in the last bucket */
+#define ENGINE_TAP_SAMPLES  8	/* of each kind, before learning starts */
+#define ENGINE_TAP_WINDOW   1024	/* samples, before older ones are aged */
+
+/* A key to inject */
+typedef struct Action_s {
+    uint8_t keycode;
+    bool key_down;
+    bool mapped;		/* pressed through a layer, not as it was */
+} Action_t;
+
+/* A layer: what each key becomes while its modifier is held */
+typedef struct EngineLayer_s {
+    uint8_t modifier;
+    uint8_t map[256];
+} EngineLayer_t;
+
+/*
+ * What an engine is configured with. Tables are never changed once in
+ * use: a new configuration is a new table, compiled before it is used.
+ */
+typedef struct EngineTable_s {
+    /*
+     * Layer 0 is the half keyboard: the layout's mirror table, with
+     * SPACE as its modifier. Any more are configured on top.
+     */
+    EngineLayer_t layers[ENGINE_MAX_LAYERS];
+    uint8_t nlayers;
+    uint8_t cancel;		/* the key which cancels a held modifier */
+    /*
+     * Off, every key is injected as it is. A hold already under way is
+     * finished as it began, so nothing is left mirrored.
+     */
+    bool enabled;
+    bool mirror_mode;		/* mirror all keys before the state machine */
+    /*
+     * A modifier held for less than tap_threshold ms before a mirrored
+     * key is pressed is a tap rolled into that key. 0 for off.
+     */
+    uint16_t tap_threshold;
+    bool tap_adaptive;		/* learn the threshold from typing instead */
+
+    /* Compiled: the layer each key is the modifier of, plus one, or 0 */
+    uint8_t layer_of[256];
+} EngineTable_t;
+
+/*
+ * The lead, from modifier press to the first mirrored key, of every hold
+ * which overlapped one, by what it turned out to be: a roll if the
+ * modifier went up first, a chord if the key did.
+ */
+typedef struct EngineTiming_s {
+    uint16_t rolls[ENGINE_TAP_BUCKETS];
+    uint16_t chords[ENGINE_TAP_BUCKETS];
+    unsigned int nrolls;
+    unsigned int nchords;
+    uint16_t threshold;		/* learned, 0 until then */
+} EngineTiming_t;
+
+/* What an engine has done, counted by the thread running it */
+typedef struct EngineStats_s {
+    unsigned long mirrored;	/* presses injected mirrored */
+    unsigned long passthrough;	/* presses injected as they were */
+    unsigned long taps;		/* modifier presses typed as the key itself */
+    unsigned long holds;	/* modifier presses used to mirror */
+    unsigned long inversions;	/* releases of mirrored keys after their modifier */
+} EngineStats_t;
+
+/* The state of one layer's modifier */
+typedef struct EngineHold_s {
+    int space;			/* SPACE_STATE_*, whatever the modifier */
+    uint32_t order;		/* which modifier went down last */
+    uint32_t modifier_time;	/* when the modifier went down */
+    uint8_t lead_key;		/* first mirrored key of this hold, while down */
+    uint32_t lead;		/* from modifier_time to lead_key, ms */
+} EngineHold_t;
+
+/*
+ * All of the state of one keyboard. Engines are independent of each other,
+ * so any number may be run side by side.
+ */
+typedef struct Engine_s {
+    const EngineTable_t * table;
+
+    EngineHold_t layers[ENGINE_MAX_LAYERS];
+    uint32_t presses;		/* of any modifier, to order the layers */
+    uint8_t held;		/* a bit for each layer PRESSED or MODIFIED */
+
+    uint8_t keystates[256];	/* what we have injected, KEYSTATE_* */
+    uint8_t pressed[256];	/* the key injected for each key held, or 0 */
+    uint8_t pressed_layer[256];	/* the layer which mapped it, plus one, or 0 */
+
+    EngineTiming_t timing;
+    EngineStats_t stats;
+} Engine_t;
+
+/* A table from a layout's mirror table, with SPACE as the modifier */
+void engine_table_init(EngineTable_t * table, const uint8_t * mirror, bool mirror_mode);
+/*
+ * Add a layer on top, with nothing mapped yet. Returns it, or NULL when
+ * there are too many, or key is already a modifier.
+ */
+EngineLayer_t * engine_table_layer(EngineTable_t * table, uint8_t modifier);
+/* Build the compiled part of a table, after any change to its layers */
+void engine_table_compile(EngineTable_t * table);
+void engine_init(Engine_t * engine, const EngineTable_t * table);
+
+/*
+ * Feed one key event through the engine. The keys to inject in response
+ * are written to actions, and their number returned. Time is the event's
+ * own timestamp in milliseconds, so the same events always give the same
+ * result, however fast they are fed in.
+ */
+int engine_process(Engine_t * engine, int keycode, bool key_down, bool repeat,
+                   uint32_t time, Action_t actions[ENGINE_MAX_ACTIONS]);
+
+/*
+ * Release every key the engine has injected as held, and forget any hold
+ * of the modifier. Returns the number of actions, at most 256.
+ */
+int engine_release(Engine_t * engine, Action_t actions[256]);
+
+/* The tap threshold in force, in milliseconds, 0 when off */
+unsigned int engine_tap_threshold(const Engine_t * engine);
+
+const char * engine_state_name(int state);
+/* The state of every layer, two bits each from layer 0 up, for tracing */
+unsigned int engine_layer_states(const Engine_t * engine);
+
+#endif /* XHK_ENGINE_H_ */
@@ -0,0 +1,448 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Event I/O over Linux evdev and uinput.
+
+    The keyboard is grabbed with EVIOCGRAB so that nobody else sees its
+    events, and the processed keys are emitted from a uinput virtual
+    keyboard. Neither direction passes through an X server, so this works
+    equally on the console and under Wayland.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+
+/* X keycodes are evdev keycodes offset by 8 */
+#define EVDEV_OFFSET 8
+#define EVDEV_MAX_KEY (255 - EVDEV_OFFSET)
+
+#define BIT_WORDS(n) (((n) + 8 * sizeof(long) - 1) / (8 * sizeof(long)))
+
+static int input_fd = -1;
+static int uinput_fd = -1;
+static LoopSource_t * Source;
+
+/* Every injected key is followed by a SYN_REPORT, all written at once */
+static struct input_event output[INJECT_QUEUE_SIZE * 2];
+static int output_count;
+
+static int uinput_create(const char * name)
+{
+    struct uinput_setup setup = {
+        .id = {
+            .bustype = BUS_VIRTUAL,
+            .vendor = 0x1,
+            .product = 0x1,
+        },
+    };
+    int fd;
+
+    fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        ERROR("Couldn't open /dev/uinput: %s\n", strerror(errno));
+        return -1;
+    }
+
+    strncpy(setup.name, name, UINPUT_MAX_NAME_SIZE - 1);
+
+    /*
+     * The kernel autorepeats keys held on the virtual keyboard itself,
+     * so repeats from the source device are never re-injected.
+     */
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_REP);
+
+    /* Anything an X keycode can express */
+    for (int code = 1; code <= EVDEV_MAX_KEY; code++)
+        ioctl(fd, UI_SET_KEYBIT, code);
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        ERROR("Couldn't create uinput device: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    DEBUG("Created uinput device \"%s\"\n", name);
+
+    return fd;
+}
+
+/* Find the /dev/input/eventN node of a device we created through uinput */
+static char * uinput_devnode(int fd)
+{
+    char sysname[64];
+    char * path = NULL;
+    struct dirent * entry;
+    DIR * dir;
+
+    if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+        return NULL;
+
+    if (asprintf(&path, "/sys/devices/virtual/input/%s", sysname) < 0)
+        return NULL;
+
+    dir = opendir(path);
+    free(path);
+    path = NULL;
+    if (!dir)
+        return NULL;
+
+    while ((entry = readdir(dir)))
+        if (strncmp(entry->d_name, "event", 5) == 0) {
+            if (asprintf(&path, "/dev/input/%s", entry->d_name) < 0)
+                path = NULL;
+            break;
+        }
+
+    closedir(dir);
+
+    return path;
+}
+
+/* A new device node takes a moment for udev to create */
+static int open_devnode(const char * path, int flags)
+{
+    int fd = -1;
+
+    for (int tries = 0; tries < 100 && fd < 0; tries++) {
+        fd = open(path, flags | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT)
+            usleep(10000);
+        else
+            break;
+    }
+
+    return fd;
+}
+
+/*
+ * Keys held while we grab the device would have their release events
+ * stolen from whoever saw them pressed, so wait for them to be let go.
+ */
+static void wait_for_keys_released(int fd)
+{
+    unsigned long keys[BIT_WORDS(KEY_CNT)];
+
+    for (int tries = 0; tries < 200; tries++) {
+        bool held = false;
+
+        memset(keys, 0, sizeof(keys));
+        if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0)
+            return;
+
+        for (size_t i = 0; i < BIT_WORDS(KEY_CNT); i++)
+            held |= keys[i] != 0;
+
+        if (!held)
+            return;
+
+        usleep(10000);
+    }
+
+    ERROR("Keys are still held, grabbing anyway\n");
+}
+
+static void dispatch(XWindowsScreen_t * screen, struct input_event * ev)
+{
+    KeyEvent_t key;
+
+    if (ev->type != EV_KEY || ev->code > EVDEV_MAX_KEY)
+        return;
+
+    /* The virtual keyboard autorepeats on its own */
+    if (ev->value == 2)
+        return;
+
+    key = (KeyEvent_t) {
+        .deviceid = 0,
+        .keycode = ev->code + EVDEV_OFFSET,
+        .repeat = false,
+        .time = ev->input_event_sec * 1000UL + ev->input_event_usec / 1000,
+        .received = latency_now(),
+    };
+
+    if (ev->value)
+        handle_key_press(screen, &key);
+    else
+        handle_key_release(screen, &key);
+}
+
+/*
+ * Drain everything that has arrived, so that all of the resulting key
+ * events go out in one write.
+ */
+static void evdev_dispatch(void * data)
+{
+    XWindowsScreen_t * screen = data;
+    struct input_event events[64];
+    ssize_t len;
+
+    while ((len = read(input_fd, events, sizeof(events))) > 0)
+        for (size_t i = 0; i < len / sizeof(events[0]); i++)
+            dispatch(screen, &events[i]);
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        ERROR("Reading keyboard failed: %s, closing down\n", strerror(errno));
+        ApplicationRunning = false;
+    }
+
+    FlushKeys(screen);
+}
+
+static int evdev_attach(XWindowsScreen_t * screen)
+{
+    Source = loop_add_fd(input_fd, evdev_dispatch, NULL, screen);
+
+    return Source ? 0 : -1;
+}
+
+static int evdev_fake_key(XWindowsScreen_t * screen, int keycode, bool key_down)
+{
+    if (keycode < EVDEV_OFFSET)
+        return 0;
+
+    output[output_count++] = (struct input_event) {
+        .type = EV_KEY,
+        .code = keycode - EVDEV_OFFSET,
+        .value = key_down,
+    };
+    output[output_count++] = (struct input_event) {
+        .type = EV_SYN,
+        .code = SYN_REPORT,
+    };
+
+    return 1;
+}
+
+static void evdev_flush(XWindowsScreen_t * screen)
+{
+    size_t len = output_count * sizeof(output[0]);
+
+    if (output_count && write(uinput_fd, output, len) != (ssize_t)len)
+        ERROR("uinput write failed: %s\n", strerror(errno));
+
+    output_count = 0;
+}
+
+static void evdev_close(XWindowsScreen_t * screen)
+{
+    loop_remove(Source);
+    Source = NULL;
+
+    if (uinput_fd >= 0) {
+        ioctl(uinput_fd, UI_DEV_DESTROY);
+        close(uinput_fd);
+        uinput_fd = -1;
+    }
+
+    if (input_fd >= 0) {
+        ioctl(input_fd, EVIOCGRAB, 0);
+        close(input_fd);
+        input_fd = -1;
+    }
+
+    screen->io = NULL;
+}
+
+static const struct xhk_io evdev_io = {
+    .name = "evdev",
+    .monotonic_time = true,
+    .attach = evdev_attach,
+    .fake_key = evdev_fake_key,
+    .flush = evdev_flush,
+    .close = evdev_close,
+};
+
+int evdev_io_open(XWindowsScreen_t * screen, const char * device)
+{
+    char name[256] = "unknown";
+
+    input_fd = open_devnode(device, O_RDONLY | O_NONBLOCK);
+    if (input_fd < 0) {
+        ERROR("Couldn't open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    ioctl(input_fd, EVIOCGNAME(sizeof(name)), name);
+
+    /* Timestamp events on the clock the latency tracer uses */
+    ioctl(input_fd, EVIOCSCLOCKID, &(int) {
+        CLOCK_MONOTONIC
+    });
+    printf("Using evdev device %s (%s)\n", device, name);
+
+    wait_for_keys_released(input_fd);
+
+    if (ioctl(input_fd, EVIOCGRAB, 1) < 0) {
+        ERROR("Couldn't grab %s: %s\n", device, strerror(errno));
+        close(input_fd);
+        input_fd = -1;
+        return -1;
+    }
+
+    uinput_fd = uinput_create("xhk virtual keyboard");
+    if (uinput_fd < 0) {
+        ioctl(input_fd, EVIOCGRAB, 0);
+        close(input_fd);
+        input_fd = -1;
+        return -1;
+    }
+
+    add_keyboard(screen, 0, 0, name);
+
+    screen->io = &evdev_io;
+
+    return 0;
+}
+
+/*
+ * Loopback test: a uinput keyboard stands in for the physical one, and
+ * what xhk emits is read back from its own virtual keyboard.
+ */
+static const struct {
+    int code;
+    int value;
+} TestInput[] = {
+    { KEY_A, 1 }, { KEY_A, 0 },                                 /* passthrough */
+    { KEY_SPACE, 1 }, { KEY_SPACE, 0 },                         /* tapped space */
+    { KEY_SPACE, 1 }, { KEY_F, 1 }, { KEY_F, 0 }, { KEY_SPACE, 0 }, /* mirrored */
+}, TestOutput[] = {
+    { KEY_A, 1 }, { KEY_A, 0 },
+    { KEY_SPACE, 1 }, { KEY_SPACE, 0 },
+    { KEY_J, 1 }, { KEY_J, 0 },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+int evdev_test(void)
+{
+    XWindowsScreen_t screen = { 0 };
+    struct input_event ev[2];
+    char * source_path = NULL, * output_path = NULL;
+    int source_fd, output_fd = -1;
+    size_t received = 0;
+    int errors = 0;
+
+    if (loop_init())
+        return -1;
+
+    source_fd = uinput_create("xhk test source keyboard");
+    if (source_fd < 0) {
+        loop_close();
+        return -1;
+    }
+
+    source_path = uinput_devnode(source_fd);
+    if (!source_path || evdev_io_open(&screen, source_path) || screen.io->attach(&screen)) {
+        ERROR("Couldn't attach to the test source keyboard\n");
+        errors++;
+        goto out;
+    }
+
+    output_path = uinput_devnode(uinput_fd);
+    if (output_path)
+        output_fd = open_devnode(output_path, O_RDONLY | O_NONBLOCK);
+    if (output_fd < 0) {
+        ERROR("Couldn't open the xhk virtual keyboard\n");
+        errors++;
+        goto out;
+    }
+
+    INFO("Entering Test Loop...\n");
+
+    for (size_t i = 0; i < ARRAY_SIZE(TestInput); i++) {
+        memset(ev, 0, sizeof(ev));
+        ev[0].type = EV_KEY;
+        ev[0].code = TestInput[i].code;
+        ev[0].value = TestInput[i].value;
+        ev[1].type = EV_SYN;
+        ev[1].code = SYN_REPORT;
+
+        if (write(source_fd, ev, sizeof(ev)) != sizeof(ev)) {
+            ERROR("Test source write failed: %s\n", strerror(errno));
+            errors++;
+            goto out;
+        }
+
+        if (loop_iterate(1000) <= 0) {
+            ERROR("Timed out waiting for test key %zu\n", i);
+            errors++;
+        }
+    }
+
+    /* Give the kernel a moment to deliver the last of our output */
+    poll(&(struct pollfd) {
+        .fd = output_fd, .events = POLLIN
+    }, 1, 100);
+
+    while (read(output_fd, ev, sizeof(ev[0])) == sizeof(ev[0])) {
+        if (ev[0].type != EV_KEY || ev[0].value == 2)
+            continue;
+
+        if (received >= ARRAY_SIZE(TestOutput)) {
+            ERROR("Unexpected extra key %d %s\n", ev[0].code, ev[0].value ? "Down" : "Up");
+            errors++;
+        } else if (ev[0].code != TestOutput[received].code || ev[0].value != TestOutput[received].value) {
+            ERROR("Key %zu was %d %s but expected %d %s\n", received,
+                  ev[0].code, ev[0].value ? "Down" : "Up",
+                  TestOutput[received].code, TestOutput[received].value ? "Down" : "Up");
+            errors++;
+        }
+        received++;
+    }
+
+    if (received < ARRAY_SIZE(TestOutput)) {
+        ERROR("Only %zu of %zu expected keys were emitted\n", received, ARRAY_SIZE(TestOutput));
+        errors++;
+    }
+
+    INFO("\nExiting Test Loop with %d errors...\n", errors);
+
+out:
+    if (output_fd >= 0)
+        close(output_fd);
+    if (screen.io)
+        screen.io->close(&screen);
+    free_keyboards(&screen);
+    ioctl(source_fd, UI_DEV_DESTROY);
+    close(source_fd);
+    free(source_path);
+    free(output_path);
+    loop_close();
+
+    return errors;
+}
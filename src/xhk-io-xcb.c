@@ -0,0 +1,274 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Event I/O natively over XCB.
+
+    Setup, device management and the occasional focus query stay on Xlib,
+    but Xlib hands the event queue over to XCB. Events are then read and
+    decoded in place from XCB's buffers, and fake input is sent unchecked,
+    without Xlib's locking or event copies on the hot path.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xinput.h>
+#include <xcb/xtest.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+
+static uint8_t xi_opcode;
+
+static LoopSource_t * Source;
+/* An event found already queued before waiting, to dispatch first */
+static xcb_generic_event_t * Queued;
+
+/* Each screen has its own connection, so the injector may have another */
+static inline xcb_connection_t * connection(XWindowsScreen_t * screen)
+{
+    return XGetXCBConnection(screen->display);
+}
+
+/*
+ * XI2 key events are decoded directly from XCB's event buffer. KeyPress
+ * and KeyRelease share a layout, so one cast covers both.
+ */
+static void process_key_event(XWindowsScreen_t * screen, xcb_input_key_press_event_t * event)
+{
+    KeyEvent_t key = {
+        .deviceid = event->deviceid,
+        .keycode = event->detail,
+        .repeat = (event->flags & XCB_INPUT_KEY_EVENT_FLAGS_KEY_REPEAT) != 0,
+        .time = event->time,
+        .received = latency_now(),
+    };
+
+    if (event->event_type == XCB_INPUT_KEY_PRESS)
+        handle_key_press(screen, &key);
+    else
+        handle_key_release(screen, &key);
+}
+
+/* From XI 2.2: the same key, without the window and pointer state */
+static void process_raw_event(XWindowsScreen_t * screen, xcb_input_raw_key_press_event_t * event)
+{
+    KeyEvent_t key = {
+        .deviceid = event->deviceid,
+        .keycode = event->detail,
+        .repeat = (event->flags & XCB_INPUT_KEY_EVENT_FLAGS_KEY_REPEAT) != 0,
+        .time = event->time,
+        .received = latency_now(),
+    };
+
+    if (event->event_type == XCB_INPUT_RAW_KEY_PRESS)
+        handle_key_press(screen, &key);
+    else
+        handle_key_release(screen, &key);
+}
+
+static void process_hierarchy_event(XWindowsScreen_t * screen, xcb_input_hierarchy_event_t * event)
+{
+    xcb_input_hierarchy_info_t * info = xcb_input_hierarchy_infos(event);
+    int ninfos = xcb_input_hierarchy_infos_length(event);
+
+    for (int i = 0; i < ninfos; i++)
+        if (info[i].flags)
+            handle_hierarchy(screen, info[i].deviceid, info[i].flags);
+}
+
+static void process_xi_event(XWindowsScreen_t * screen, xcb_ge_generic_event_t * ge)
+{
+    xcb_input_device_changed_event_t * changed = (xcb_input_device_changed_event_t *)ge;
+
+    switch (ge->event_type) {
+    case XCB_INPUT_KEY_PRESS:
+    case XCB_INPUT_KEY_RELEASE:
+        process_key_event(screen, (xcb_input_key_press_event_t *)ge);
+        break;
+    case XCB_INPUT_RAW_KEY_PRESS:
+    case XCB_INPUT_RAW_KEY_RELEASE:
+        process_raw_event(screen, (xcb_input_raw_key_press_event_t *)ge);
+        break;
+    case XCB_INPUT_HIERARCHY:
+        process_hierarchy_event(screen, (xcb_input_hierarchy_event_t *)ge);
+        break;
+    case XCB_INPUT_DEVICE_CHANGED:
+        if (changed->reason == XCB_INPUT_CHANGE_REASON_DEVICE_CHANGE)
+            handle_device_changed(screen, changed->deviceid);
+        break;
+    default:
+        INFO("Unhandled XI Event Received of type %d\n", ge->event_type);
+        break;
+    }
+}
+
+static void process_event(XWindowsScreen_t * screen, xcb_generic_event_t * ev)
+{
+    switch (ev->response_type & ~0x80) {
+    case 0: {
+        xcb_generic_error_t * error = (xcb_generic_error_t *)ev;
+        DEBUG("X Error %d on request %d.%d\n", error->error_code, error->major_code, error->minor_code);
+        break;
+    }
+    case XCB_PROPERTY_NOTIFY:
+        handle_property_notify(screen, ((xcb_property_notify_event_t *)ev)->atom);
+        break;
+    case XCB_FOCUS_IN:
+        handle_focus_in(screen);
+        break;
+    case XCB_GE_GENERIC:
+        if (((xcb_ge_generic_event_t *)ev)->extension == xi_opcode)
+            process_xi_event(screen, (xcb_ge_generic_event_t *)ev);
+        break;
+    default:
+        if (screen->xkb_event && (ev->response_type & ~0x80) == screen->xkb_event)
+            handle_keymap_notify(screen);
+        break;
+    }
+
+    free(ev);
+}
+
+/*
+ * Drain everything that has arrived, so that all of the resulting key
+ * events go out in one flush.
+ */
+static void xcb_dispatch(void * data)
+{
+    XWindowsScreen_t * screen = data;
+    xcb_connection_t * conn = connection(screen);
+    xcb_generic_event_t * ev;
+
+    if (Queued) {
+        ev = Queued;
+        Queued = NULL;
+        process_event(screen, ev);
+    }
+
+    while ((ev = xcb_poll_for_event(conn)))
+        process_event(screen, ev);
+
+    if (xcb_connection_has_error(conn)) {
+        ERROR("Connection to the X server lost, closing down\n");
+        ApplicationRunning = false;
+    }
+
+    FlushKeys(screen);
+}
+
+/*
+ * Events read while waiting for a reply are queued without waking us.
+ * XCB can't peek, so hold on to the first for xcb_dispatch().
+ */
+static bool xcb_pending(void * data)
+{
+    XWindowsScreen_t * screen = data;
+
+    if (!Queued)
+        Queued = xcb_poll_for_queued_event(connection(screen));
+
+    return Queued != NULL;
+}
+
+static int xcb_attach(XWindowsScreen_t * screen)
+{
+    Source = loop_add_fd(xcb_get_file_descriptor(connection(screen)), xcb_dispatch, xcb_pending, screen);
+
+    return Source ? 0 : -1;
+}
+
+static int xcb_fake_key(XWindowsScreen_t * screen, int keycode, bool key_down)
+{
+    /* Unchecked: any error arrives asynchronously in the event stream */
+    xcb_void_cookie_t cookie = xcb_test_fake_input(connection(screen), key_down ? XCB_KEY_PRESS : XCB_KEY_RELEASE,
+                                                   keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+
+    /* Xlib's count misses what goes straight to XCB; the sequence doesn't */
+    statistic_requests(screen, cookie.sequence);
+    return 1;
+}
+
+static void xcb_io_flush(XWindowsScreen_t * screen)
+{
+    xcb_flush(connection(screen));
+}
+
+static void xcb_io_close(XWindowsScreen_t * screen)
+{
+    if (Source && Source->data == screen) {
+        loop_remove(Source);
+        Source = NULL;
+        free(Queued);
+        Queued = NULL;
+    }
+
+    screen->io = NULL;
+}
+
+static const struct xhk_io xcb_io = {
+    .name = "xcb",
+    .monotonic_time = true,
+    .attach = xcb_attach,
+    .fake_key = xcb_fake_key,
+    .flush = xcb_io_flush,
+    .close = xcb_io_close,
+};
+
+int x11_io_open(XWindowsScreen_t * screen)
+{
+    const xcb_query_extension_reply_t * xi, * xtest;
+    xcb_connection_t * conn;
+    xcb_test_get_version_cookie_t cookie;
+    xcb_test_get_version_reply_t * version;
+
+    /* This must happen before Xlib reads any events */
+    XSetEventQueueOwner(screen->display, XCBOwnsEventQueue);
+    conn = XGetXCBConnection(screen->display);
+
+    /* Put both extension queries on the wire before waiting on either */
+    xcb_prefetch_extension_data(conn, &xcb_input_id);
+    xcb_prefetch_extension_data(conn, &xcb_test_id);
+
+    xi = xcb_get_extension_data(conn, &xcb_input_id);
+    xtest = xcb_get_extension_data(conn, &xcb_test_id);
+    if (!xi || !xi->present || !xtest || !xtest->present) {
+        ERROR("XInput or XTEST extension not available through XCB\n");
+        return -1;
+    }
+
+    cookie = xcb_test_get_version(conn, 2, 2);
+    version = xcb_test_get_version_reply(conn, cookie, NULL);
+    if (!version) {
+        ERROR("XTEST version query failed\n");
+        return -1;
+    }
+
+    INFO("XCB event path, XTEST version %d.%d\n", version->major_version, version->minor_version);
+    free(version);
+
+    xi_opcode = xi->major_opcode;
+    screen->io = &xcb_io;
+
+    return 0;
+}
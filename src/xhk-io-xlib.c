@@ -0,0 +1,190 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Event I/O over Xlib.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/XInput2.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+
+static LoopSource_t * Source;
+
+static void process_key_event(XWindowsScreen_t * screen, XIDeviceEvent * event)
+{
+    KeyEvent_t key = {
+        .deviceid = event->deviceid,
+        .keycode = event->detail,
+        .repeat = (event->flags & XIKeyRepeat) != 0,
+        .time = event->time,
+        .received = latency_now(),
+    };
+
+    if (event->evtype == XI_KeyPress)
+        handle_key_press(screen, &key);
+    else
+        handle_key_release(screen, &key);
+}
+
+/* From XI 2.2: the same key, without the window and pointer state */
+static void process_raw_event(XWindowsScreen_t * screen, XIRawEvent * event)
+{
+    KeyEvent_t key = {
+        .deviceid = event->deviceid,
+        .keycode = event->detail,
+        .repeat = (event->flags & XIKeyRepeat) != 0,
+        .time = event->time,
+        .received = latency_now(),
+    };
+
+    if (event->evtype == XI_RawKeyPress)
+        handle_key_press(screen, &key);
+    else
+        handle_key_release(screen, &key);
+}
+
+static void process_xi_event(XWindowsScreen_t * screen, XIEvent * event)
+{
+    XIHierarchyEvent * hierarchy = (XIHierarchyEvent *)event;
+    XIDeviceChangedEvent * changed = (XIDeviceChangedEvent *)event;
+
+    switch(event->evtype) {
+    case XI_KeyPress:
+    case XI_KeyRelease:
+        process_key_event(screen, (XIDeviceEvent *)event);
+        break;
+    case XI_RawKeyPress:
+    case XI_RawKeyRelease:
+        process_raw_event(screen, (XIRawEvent *)event);
+        break;
+    case XI_HierarchyChanged:
+        for (int i = 0; i < hierarchy->num_info; i++)
+            if (hierarchy->info[i].flags)
+                handle_hierarchy(screen, hierarchy->info[i].deviceid, hierarchy->info[i].flags);
+        break;
+    case XI_DeviceChanged:
+        if (changed->reason == XIDeviceChange)
+            handle_device_changed(screen, changed->deviceid);
+        break;
+    default:
+        INFO("Unhandled XI Event Received of type %d\n", event->evtype);
+        break;
+    }
+}
+
+static int process_event(XWindowsScreen_t * screen, XEvent * ev)
+{
+    switch (ev->type) {
+    case PropertyNotify:
+        handle_property_notify(screen, ev->xproperty.atom);
+        return 0;
+    case FocusIn:
+        handle_focus_in(screen);
+        return 0;
+    }
+
+    if (screen->xkb_event && ev->type == screen->xkb_event) {
+        handle_keymap_notify(screen);
+        return 0;
+    }
+
+    if (ev->xcookie.type == GenericEvent &&
+//        ev->xcookie.extension == opcode &&
+        XGetEventData(screen->display, &ev->xcookie)) {
+        process_xi_event(screen, ev->xcookie.data);
+        XFreeEventData(screen->display, &ev->xcookie);
+    }
+
+    return 0;
+}
+
+/*
+ * Drain everything that has arrived, so that all of the resulting key
+ * events go out in one flush. XEventsQueued(QueuedAfterReading) reads
+ * what the socket holds without blocking, and unlike XPending() does not
+ * flush the output buffer on every pass, so the flush stays single.
+ */
+static void xlib_dispatch(void * data)
+{
+    XWindowsScreen_t * screen = data;
+    XEvent ev;
+
+    while (XEventsQueued(screen->display, QueuedAfterReading)) {
+        XNextEvent(screen->display, &ev);
+        process_event(screen, &ev);
+    }
+
+    FlushKeys(screen);
+}
+
+/* Events read while waiting for a reply are queued without waking us */
+static bool xlib_pending(void * data)
+{
+    XWindowsScreen_t * screen = data;
+
+    return XEventsQueued(screen->display, QueuedAlready) > 0;
+}
+
+static int xlib_attach(XWindowsScreen_t * screen)
+{
+    Source = loop_add_fd(ConnectionNumber(screen->display), xlib_dispatch, xlib_pending, screen);
+
+    return Source ? 0 : -1;
+}
+
+static int xlib_fake_key(XWindowsScreen_t * screen, int keycode, bool key_down)
+{
+    return XTestFakeKeyEvent(screen->display, keycode, key_down, CurrentTime);
+}
+
+static void xlib_flush(XWindowsScreen_t * screen)
+{
+    XFlush(screen->display);
+    statistic_requests(screen, NextRequest(screen->display) - 1);
+}
+
+static void xlib_close(XWindowsScreen_t * screen)
+{
+    if (Source && Source->data == screen) {
+        loop_remove(Source);
+        Source = NULL;
+    }
+
+    screen->io = NULL;
+}
+
+static const struct xhk_io xlib_io = {
+    .name = "xlib",
+    .monotonic_time = true,
+    .attach = xlib_attach,
+    .fake_key = xlib_fake_key,
+    .flush = xlib_flush,
+    .close = xlib_close,
+};
+
+int x11_io_open(XWindowsScreen_t * screen)
+{
+    screen->io = &xlib_io;
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Keysym and keysym name cache for the server's keymap.
+
+    XkbKeycodeToKeysym() and XKeysymToString() are too slow to call for
+    every key, the latter searching the keysym name table, and with XCB
+    owning the event queue Xlib never learns that the keymap changed. So
+    the whole map is read once, and read again only on an XkbMapNotify,
+    XkbNamesNotify or XkbNewKeyboardNotify event.
+
+    The XKB key names are read along with it. Layouts name their keys by
+    where they sit (AC01 is the first letter of the home row), so looking
+    the names up here fits the mirror tables onto whatever keycodes this
+    keyboard uses, ANSI, ISO, JIS or otherwise.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <X11/XKBlib.h>
+
+#include "xhk.h"
+#include "xhk-config.h"
+#include "xhk-keymap.h"
+#include "xhk-keynames.h"
+#include "xhk-loop.h"
+#include "xhk-trace.h"
+
+/* A keymap change comes as a burst of events: rebuild once it is over */
+#define KEYMAP_SETTLE_NS (10 * 1000000ULL)
+
+#define KEYMAP_NAME_SIZE 32
+
+static struct {
+    KeySym keysym[256];			/* NoSymbol when unbound */
+    char name[256][KEYMAP_NAME_SIZE];	/* "" when unbound */
+    unsigned int builds;		/* times the cache has been built */
+} Keymap;
+
+static XWindowsScreen_t * KeymapScreen;
+static LoopSource_t * Rebuild;
+
+/* Where each standard pc105 keycode is on this keyboard, or 0 if absent */
+static uint8_t Remap[256];
+static bool Remapped;
+
+/* The keycode with an XKB key name, or an alias of it, or 0 for none */
+static int find_keycode(XkbDescPtr xkb, const char * name)
+{
+    XkbKeyAliasPtr aliases = xkb->names->key_aliases;
+
+    for (int i = 0; aliases && i < xkb->names->num_key_aliases; i++)
+        if (strncmp(aliases[i].alias, name, XkbKeyNameLength) == 0) {
+            name = aliases[i].real;
+            break;
+        }
+
+    for (int keycode = xkb->min_key_code; keycode <= xkb->max_key_code; keycode++)
+        if (strncmp(xkb->names->keys[keycode].name, name, XkbKeyNameLength) == 0)
+            return keycode;
+
+    return 0;
+}
+
+/* Move the layout onto this keyboard's keycodes, if they differ at all */
+static void keymap_remap(XkbDescPtr xkb)
+{
+    uint8_t remap[256];
+    int moved = 0, missing = 0;
+
+    for (int i = 0; i < 256; i++)
+        remap[i] = i;
+
+    for (size_t i = 0; i < sizeof(KeyNames) / sizeof(KeyNames[0]); i++) {
+        int keycode = find_keycode(xkb, KeyNames[i].name);
+
+        remap[KeyNames[i].keycode] = keycode;
+        moved += keycode && keycode != KeyNames[i].keycode;
+        missing += !keycode;
+    }
+
+    if (moved || missing)
+        INFO("Keyboard has %d keys on other keycodes, and %d missing\n", moved, missing);
+
+    /* Nothing to do, or to undo */
+    if (!moved && !missing && !Remapped)
+        return;
+    if (Remapped && memcmp(remap, Remap, sizeof(Remap)) == 0)
+        return;
+
+    Remapped = moved || missing;
+    memcpy(Remap, remap, sizeof(Remap));
+
+    config_remap(Remapped ? Remap : NULL);
+}
+
+static int keymap_build(XWindowsScreen_t * screen)
+{
+    XkbDescPtr xkb;
+    int bound = 0;
+
+    xkb = XkbGetMap(screen->display, XkbKeySymsMask, XkbUseCoreKbd);
+    if (!xkb) {
+        ERROR("Couldn't read the keymap\n");
+        return -1;
+    }
+
+    if (XkbGetNames(screen->display, XkbKeyNamesMask | XkbKeyAliasesMask, xkb) == Success
+            && xkb->names && xkb->names->keys)
+        keymap_remap(xkb);
+    else
+        ERROR("Couldn't read the key names, assuming standard keycodes\n");
+
+    memset(Keymap.keysym, 0, sizeof(Keymap.keysym));
+    memset(Keymap.name, 0, sizeof(Keymap.name));
+
+    for (int keycode = xkb->min_key_code; keycode <= xkb->max_key_code; keycode++) {
+        const char * name;
+        KeySym keysym;
+
+        if (XkbKeyNumSyms(xkb, keycode) == 0)
+            continue;
+
+        keysym = XkbKeySymEntry(xkb, keycode, 0, 0);
+        name = XKeysymToString(keysym);
+
+        Keymap.keysym[keycode] = keysym;
+        if (name)
+            snprintf(Keymap.name[keycode], KEYMAP_NAME_SIZE, "%s", name);
+        bound += keysym != NoSymbol;
+    }
+
+    XkbFreeKeyboard(xkb, XkbAllComponentsMask, True);
+
+    Keymap.builds++;
+    INFO("Keymap read, %d keycodes bound\n", bound);
+    TRACE(KEYMAP, bound, Keymap.builds, 0, 0);
+
+    return 0;
+}
+
+static void keymap_rebuild(void * data)
+{
+    keymap_build(KeymapScreen);
+}
+
+void handle_keymap_notify(XWindowsScreen_t * screen)
+{
+    if (screen == KeymapScreen && Rebuild)
+        loop_timer_after(Rebuild, KEYMAP_SETTLE_NS);
+}
+
+int keymap_open(XWindowsScreen_t * screen)
+{
+    unsigned int events = XkbMapNotifyMask | XkbNamesNotifyMask | XkbNewKeyboardNotifyMask;
+    int opcode, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+
+    if (!XkbQueryExtension(screen->display, &opcode, &screen->xkb_event, &error, &major, &minor)) {
+        ERROR("XKB extension not available\n");
+        return -1;
+    }
+
+    KeymapScreen = screen;
+
+    if (keymap_build(screen))
+        return -1;
+
+    Rebuild = loop_add_timer(keymap_rebuild, NULL);
+    if (!Rebuild)
+        return -1;
+
+    XkbSelectEvents(screen->display, XkbUseCoreKbd, events, events);
+
+    return 0;
+}
+
+void keymap_close(void)
+{
+    Remapped = false;
+
+    loop_remove(Rebuild);
+    Rebuild = NULL;
+    KeymapScreen = NULL;
+}
+
+KeySym keymap_keysym(int keycode)
+{
+    return Keymap.keysym[(uint8_t)keycode];
+}
+
+int keymap_keycode(KeySym keysym)
+{
+    for (int keycode = 8; keycode < 256; keycode++)
+        if (Keymap.keysym[keycode] == keysym)
+            return keycode;
+
+    return 0;
+}
+
+const char * keymap_name(int keycode)
+{
+    static char number[8];
+
+    keycode = (uint8_t)keycode;
+
+    if (Keymap.name[keycode][0])
+        return Keymap.name[keycode];
+
+    snprintf(number, sizeof(number), "%d", keycode);
+    return number;
+}
@@ -0,0 +1,50 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Keysym and keysym name cache for the server's keymap.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_KEYMAP_H_
+#define XHK_KEYMAP_H_
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+#include "xhk.h"
+
+/*
+ * Build the cache from the core keyboard's keymap, and select the XKB
+ * events which say it has changed. From then on, the event thread
+ * rebuilds it shortly after any burst of them, so reading the cache
+ * never costs a request. Each build also fits the configuration's mirror
+ * tables onto the keyboard's keycodes, through config_remap().
+ */
+int keymap_open(XWindowsScreen_t * screen);
+void keymap_close(void);
+
+/* The unshifted keysym of a keycode in the first group, or NoSymbol */
+KeySym keymap_keysym(int keycode);
+
+/* The first keycode with keysym unshifted in the first group, or 0 */
+int keymap_keycode(KeySym keysym);
+
+/* A keycode's keysym name, or its number when it has none */
+const char * keymap_name(int keycode);
+
+#endif /* XHK_KEYMAP_H_ */
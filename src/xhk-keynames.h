@@ -0,0 +1,70 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Key names, shared by the layout compiler and the configuration file.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_KEYNAMES_H_
+#define XHK_KEYNAMES_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+/* XKB key names of the pc105 evdev keymap, and the keycodes they produce */
+static const struct {
+    const char * name;
+    int keycode;
+} KeyNames[] = {
+    { "ESC",  9 },
+    { "AE01", 10 }, { "AE02", 11 }, { "AE03", 12 }, { "AE04", 13 },
+    { "AE05", 14 }, { "AE06", 15 }, { "AE07", 16 }, { "AE08", 17 },
+    { "AE09", 18 }, { "AE10", 19 }, { "AE11", 20 }, { "AE12", 21 },
+    { "BKSP", 22 }, { "TAB",  23 },
+    { "AD01", 24 }, { "AD02", 25 }, { "AD03", 26 }, { "AD04", 27 },
+    { "AD05", 28 }, { "AD06", 29 }, { "AD07", 30 }, { "AD08", 31 },
+    { "AD09", 32 }, { "AD10", 33 }, { "AD11", 34 }, { "AD12", 35 },
+    { "RTRN", 36 }, { "LCTL", 37 },
+    { "AC01", 38 }, { "AC02", 39 }, { "AC03", 40 }, { "AC04", 41 },
+    { "AC05", 42 }, { "AC06", 43 }, { "AC07", 44 }, { "AC08", 45 },
+    { "AC09", 46 }, { "AC10", 47 }, { "AC11", 48 },
+    { "TLDE", 49 }, { "LFSH", 50 }, { "BKSL", 51 },
+    { "AB01", 52 }, { "AB02", 53 }, { "AB03", 54 }, { "AB04", 55 },
+    { "AB05", 56 }, { "AB06", 57 }, { "AB07", 58 }, { "AB08", 59 },
+    { "AB09", 60 }, { "AB10", 61 },
+    { "RTSH", 62 }, { "LALT", 64 }, { "SPCE", 65 }, { "CAPS", 66 },
+    { "LSGT", 94 }, { "RCTL", 105 }, { "RALT", 108 },
+};
+
+/* A key is either an X keycode, or an XKB key name such as AC01 or SPCE */
+static inline int xhk_parse_key(const char * token)
+{
+    char * end;
+    long keycode = strtol(token, &end, 0);
+
+    if (*end == '\0')
+        return (keycode > 0 && keycode < 256) ? keycode : -1;
+
+    for (size_t i = 0; i < sizeof(KeyNames) / sizeof(KeyNames[0]); i++)
+        if (strcmp(token, KeyNames[i].name) == 0)
+            return KeyNames[i].keycode;
+
+    return -1;
+}
+
+#endif /* XHK_KEYNAMES_H_ */
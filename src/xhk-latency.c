@@ -0,0 +1,146 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Per-keystroke latency histograms.
+
+    Samples are recorded by the event thread with relaxed atomics and
+    never block, so that reports may be taken at any time without
+    disturbing the measurement.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdatomic.h>
+
+#include "xhk-latency.h"
+
+typedef struct Histogram_s {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[LATENCY_BUCKETS];
+} Histogram_t;
+
+static Histogram_t Histograms[LATENCY_STAGES];
+
+static const char * StageNames[LATENCY_STAGES] = {
+    "delivery",
+    "process",
+    "inject",
+    "total",
+};
+
+static int bucket_of(uint64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << LATENCY_SUB_BITS))
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+
+    /* The power of two, and the next LATENCY_SUB_BITS below it */
+    return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+           + ((ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/* The largest value which falls in a bucket */
+uint64_t latency_bucket_limit(int bucket)
+{
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t base;
+
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+
+    base = (uint64_t)((1 << LATENCY_SUB_BITS) + (bucket & ((1 << LATENCY_SUB_BITS) - 1))) << shift;
+    return base + (1ULL << shift) - 1;
+}
+
+void latency_record(enum latency_stage stage, uint64_t ns)
+{
+    Histogram_t * h = &Histograms[stage];
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    while (ns > max &&
+            !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                    memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+uint64_t latency_bucket_count(enum latency_stage stage, int bucket)
+{
+    return atomic_load_explicit(&Histograms[stage].buckets[bucket], memory_order_relaxed);
+}
+
+uint64_t latency_count(enum latency_stage stage)
+{
+    return atomic_load_explicit(&Histograms[stage].count, memory_order_relaxed);
+}
+
+uint64_t latency_sum(enum latency_stage stage)
+{
+    return atomic_load_explicit(&Histograms[stage].sum, memory_order_relaxed);
+}
+
+const char * latency_stage_name(enum latency_stage stage)
+{
+    return StageNames[stage];
+}
+
+uint64_t latency_percentile(enum latency_stage stage, double percentile)
+{
+    Histogram_t * h = &Histograms[stage];
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    uint64_t rank = count * percentile / 100.0;
+    uint64_t seen = 0;
+
+    if (count == 0)
+        return 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank)
+            return latency_bucket_limit(i) < max ? latency_bucket_limit(i) : max;
+    }
+
+    return max;
+}
+
+void latency_report(FILE * out)
+{
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s\n",
+            "latency/us", "count", "p50", "p99", "p999", "max");
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+        Histogram_t * h = &Histograms[stage];
+
+        fprintf(out, "%-10s %10lu %10.1f %10.1f %10.1f %10.1f\n", StageNames[stage],
+                (unsigned long)atomic_load_explicit(&h->count, memory_order_relaxed),
+                latency_percentile(stage, 50) / 1000.0,
+                latency_percentile(stage, 99) / 1000.0,
+                latency_percentile(stage, 99.9) / 1000.0,
+                atomic_load_explicit(&h->max, memory_order_relaxed) / 1000.0);
+    }
+
+    fflush(out);
+}
@@ -0,0 +1,68 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Per-keystroke latency histograms.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_LATENCY_H_
+#define XHK_LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+enum latency_stage {
+    LATENCY_DELIVERY,	/* device timestamp -> event read by xhk */
+    LATENCY_PROCESS,	/* event read -> ProcessKeycode() done */
+    LATENCY_INJECT,	/* ProcessKeycode() done -> injection flushed */
+    LATENCY_TOTAL,	/* event read -> injection flushed */
+    LATENCY_STAGES,
+};
+
+/*
+ * Buckets are logarithmic: four per power of two of nanoseconds, which
+ * keeps every reported percentile within 19% of the true value.
+ */
+#define LATENCY_SUB_BITS 2
+#define LATENCY_BUCKETS  (64 << LATENCY_SUB_BITS)
+
+static inline uint64_t latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Milliseconds on the same clock, as X servers and evdev (when asked) use */
+static inline uint32_t latency_now_ms(uint64_t now)
+{
+    return now / 1000000;
+}
+
+void latency_record(enum latency_stage stage, uint64_t ns);
+uint64_t latency_percentile(enum latency_stage stage, double percentile);
+uint64_t latency_bucket_limit(int bucket);
+uint64_t latency_bucket_count(enum latency_stage stage, int bucket);
+uint64_t latency_count(enum latency_stage stage);
+uint64_t latency_sum(enum latency_stage stage);	/* ns */
+const char * latency_stage_name(enum latency_stage stage);
+void latency_report(FILE * out);
+
+#endif /* XHK_LATENCY_H_ */
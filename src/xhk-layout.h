@@ -21,6 +21,17 @@
 #ifndef XHK_LAYOUT_H_
 #define XHK_LAYOUT_H_
 
+#include <stdint.h>
+
+/*
+ * A mirror table maps every keycode to its partner on the other half of
+ * the keyboard. The tables are generated from src/layouts/ by xhk-layoutc.
+ */
+struct xhk_layout {
+    const char * name;
+    const uint8_t * mirror;
+};
+
 enum EN_GB_LAYOUT {
     KEY_ESC = 9,
     KEY_1 = 10,
@@ -0,0 +1,335 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Layout compiler: turns declarative layout descriptions into constant
+    256-entry mirror tables, so that mirroring a key is a single lookup.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/*
+ * Layout file format, one statement per line, '#' starts a comment:
+ *
+ *	layout <name>		name the table (defaults to the file name)
+ *	alias <name> ...	more names for the same table
+ *	row <key> <key> ...	keys left to right, mirrored about their centre
+ *	swap <key> <key>	exchange two keys outside of the rows
+ *
+ * Keys are either X keycodes, or XKB key names such as AC01 or SPCE.
+ * Keys which are not mentioned are not mirrored. The tables work on key
+ * positions, not on what is printed on them, so national layouts which
+ * share a geometry share a file and differ only in name.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "xhk-keynames.h"
+
+#define MAX_KEYS 256
+#define MAX_LAYOUTS 32
+#define MAX_NAME 32
+#define MAX_ALIASES 8
+
+typedef struct Layout_s {
+    char name[MAX_NAME];
+    char aliases[MAX_ALIASES][MAX_NAME];
+    int nAliases;
+    const char * file;
+    int mirror[MAX_KEYS];
+} Layout_t;
+
+static Layout_t Layouts[MAX_LAYOUTS];
+static int nLayouts;
+
+static int errors;
+
+#define PARSE_ERROR(file, line, ...) do {		\
+	fprintf(stderr, "%s:%d: ", file, line);		\
+	fprintf(stderr, __VA_ARGS__);			\
+	fprintf(stderr, "\n");				\
+	errors++;					\
+} while (0)
+
+static void set_mirror(Layout_t * layout, int line, int from, int to)
+{
+    if (layout->mirror[from] != from && layout->mirror[from] != to) {
+        PARSE_ERROR(layout->file, line, "keycode %d is already mirrored to %d", from, layout->mirror[from]);
+        return;
+    }
+
+    layout->mirror[from] = to;
+}
+
+/*
+ * Half-Key row mirroring heavily based on code by John Meacham
+ * john@foo.net
+ */
+static void parse_row(Layout_t * layout, int line, char * args)
+{
+    int keys[MAX_KEYS];
+    int n = 0;
+
+    for (char * tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+        int keycode = xhk_parse_key(tok);
+        if (keycode < 0) {
+            PARSE_ERROR(layout->file, line, "unknown key '%s'", tok);
+            return;
+        }
+        if (n == MAX_KEYS) {
+            PARSE_ERROR(layout->file, line, "too many keys in row");
+            return;
+        }
+        keys[n++] = keycode;
+    }
+
+    if (n < 2) {
+        PARSE_ERROR(layout->file, line, "a row needs at least two keys");
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+        set_mirror(layout, line, keys[i], keys[n - 1 - i]);
+}
+
+static void parse_swap(Layout_t * layout, int line, char * args)
+{
+    char * a = strtok(args, " \t");
+    char * b = strtok(NULL, " \t");
+    int from, to;
+
+    if (!a || !b || strtok(NULL, " \t")) {
+        PARSE_ERROR(layout->file, line, "swap takes exactly two keys");
+        return;
+    }
+
+    from = xhk_parse_key(a);
+    to = xhk_parse_key(b);
+    if (from < 0 || to < 0) {
+        PARSE_ERROR(layout->file, line, "unknown key '%s'", from < 0 ? a : b);
+        return;
+    }
+
+    set_mirror(layout, line, from, to);
+    set_mirror(layout, line, to, from);
+}
+
+static void default_name(Layout_t * layout, const char * file)
+{
+    const char * base = strrchr(file, '/');
+    size_t len;
+
+    base = base ? base + 1 : file;
+    len = strcspn(base, ".");
+    if (len >= MAX_NAME)
+        len = MAX_NAME - 1;
+
+    memcpy(layout->name, base, len);
+    layout->name[len] = '\0';
+}
+
+static bool valid_name(const char * name)
+{
+    if (!*name || isdigit((unsigned char)*name))
+        return false;
+
+    for (; *name; name++)
+        if (!isalnum((unsigned char)*name) && *name != '_')
+            return false;
+
+    return true;
+}
+
+static void parse_alias(Layout_t * layout, int line, char * args)
+{
+    char * name = strtok(args, " \t");
+
+    if (!name)
+        PARSE_ERROR(layout->file, line, "alias needs at least one name");
+
+    for (; name; name = strtok(NULL, " \t")) {
+        if (!valid_name(name) || strlen(name) >= MAX_NAME) {
+            PARSE_ERROR(layout->file, line, "'%s' is not usable as a layout name", name);
+        } else if (layout->nAliases == MAX_ALIASES) {
+            PARSE_ERROR(layout->file, line, "too many aliases");
+            return;
+        } else {
+            strcpy(layout->aliases[layout->nAliases++], name);
+        }
+    }
+}
+
+/* Is name used by an earlier layout, or by the first upto aliases of this one? */
+static bool name_taken(const char * name, const Layout_t * self, int upto)
+{
+    for (int i = 0; i < nLayouts; i++) {
+        const Layout_t * layout = &Layouts[i];
+        int n = layout->nAliases;
+
+        if (layout == self)
+            n = upto;
+        else if (strcmp(layout->name, name) == 0)
+            return true;
+
+        for (int a = 0; a < n; a++)
+            if (strcmp(layout->aliases[a], name) == 0)
+                return true;
+    }
+
+    return false;
+}
+
+static int compile_layout(const char * file)
+{
+    Layout_t * layout;
+    char buf[1024];
+    int line = 0;
+    FILE * fp;
+
+    if (nLayouts == MAX_LAYOUTS) {
+        fprintf(stderr, "%s: too many layouts\n", file);
+        return -1;
+    }
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return -1;
+    }
+
+    layout = &Layouts[nLayouts++];
+    layout->file = file;
+    default_name(layout, file);
+
+    for (int i = 0; i < MAX_KEYS; i++)
+        layout->mirror[i] = i;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        char * cmd, * args;
+
+        line++;
+        buf[strcspn(buf, "#\r\n")] = '\0';
+
+        cmd = buf + strspn(buf, " \t");
+        if (!*cmd)
+            continue;
+        args = cmd + strcspn(cmd, " \t");
+        if (*args)
+            *args++ = '\0';
+
+        if (strcmp(cmd, "layout") == 0) {
+            char * name = strtok(args, " \t");
+            if (!name || !valid_name(name) || strlen(name) >= MAX_NAME)
+                PARSE_ERROR(file, line, "layout needs a C identifier as its name");
+            else
+                strcpy(layout->name, name);
+        } else if (strcmp(cmd, "row") == 0) {
+            parse_row(layout, line, args);
+        } else if (strcmp(cmd, "swap") == 0) {
+            parse_swap(layout, line, args);
+        } else if (strcmp(cmd, "alias") == 0) {
+            parse_alias(layout, line, args);
+        } else {
+            PARSE_ERROR(file, line, "unknown statement '%s'", cmd);
+        }
+    }
+
+    fclose(fp);
+
+    if (!valid_name(layout->name))
+        PARSE_ERROR(file, line, "'%s' is not usable as a layout name", layout->name);
+
+    if (name_taken(layout->name, layout, 0))
+        PARSE_ERROR(file, line, "layout '%s' is defined twice", layout->name);
+
+    for (int a = 0; a < layout->nAliases; a++)
+        if (strcmp(layout->aliases[a], layout->name) == 0 || name_taken(layout->aliases[a], layout, a))
+            PARSE_ERROR(file, line, "layout '%s' is defined twice", layout->aliases[a]);
+
+    return 0;
+}
+
+static void emit_tables(FILE * out)
+{
+    fprintf(out, "/* Generated by xhk-layoutc - do not edit */\n\n");
+    fprintf(out, "#ifndef XHK_MIRROR_H_\n#define XHK_MIRROR_H_\n\n");
+    fprintf(out, "#include <stdint.h>\n\n");
+
+    for (int l = 0; l < nLayouts; l++) {
+        const char * base = strrchr(Layouts[l].file, '/');
+
+        fprintf(out, "/* %s */\n", base ? base + 1 : Layouts[l].file);
+        fprintf(out, "static const uint8_t mirror_%s[256] = {", Layouts[l].name);
+        for (int i = 0; i < MAX_KEYS; i++)
+            fprintf(out, "%s%3d,", (i % 16) ? " " : "\n    ", Layouts[l].mirror[i]);
+        fprintf(out, "\n};\n\n");
+    }
+
+    fprintf(out, "static const struct xhk_layout xhk_layouts[] = {\n");
+    for (int l = 0; l < nLayouts; l++) {
+        fprintf(out, "    { \"%s\", mirror_%s },\n", Layouts[l].name, Layouts[l].name);
+        for (int a = 0; a < Layouts[l].nAliases; a++)
+            fprintf(out, "    { \"%s\", mirror_%s },\n", Layouts[l].aliases[a], Layouts[l].name);
+    }
+    fprintf(out, "    { NULL, NULL },\n};\n\n");
+
+    fprintf(out, "#endif /* XHK_MIRROR_H_ */\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char * dir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d dir] layout...\n", argv[0]);
+            return 1;
+        }
+
+    if (optind == argc) {
+        fprintf(stderr, "%s: no layouts given\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        char * path = argv[i];
+
+        if (dir && asprintf(&path, "%s/%s", dir, argv[i]) < 0)
+            return 1;
+
+        if (compile_layout(path))
+            return 1;
+    }
+
+    if (errors)
+        return 1;
+
+    emit_tables(stdout);
+
+    return ferror(stdout) ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Event loop.
+
+    Everything the event thread waits for, the keyboard, signals and
+    timers, is a descriptor in a single epoll set: a signalfd rather
+    than a signal handler, and a timerfd for each timer. The thread
+    sleeps in one epoll_wait() until one of them is ready, so uses no CPU
+    at all while idle, and never runs anything in signal context.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+
+static int EpollFd = -1;
+static LoopSource_t Sources[MAX_LOOP_SOURCES];
+
+int loop_init(void)
+{
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (EpollFd < 0) {
+        ERROR("Couldn't create the event loop: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void loop_close(void)
+{
+    for (int i = 0; i < MAX_LOOP_SOURCES; i++)
+        if (Sources[i].dispatch)
+            loop_remove(&Sources[i]);
+
+    if (EpollFd >= 0)
+        close(EpollFd);
+    EpollFd = -1;
+}
+
+LoopSource_t * loop_add_fd(int fd, loop_dispatch_t dispatch, loop_pending_t pending, void * data)
+{
+    LoopSource_t * source = NULL;
+
+    for (int i = 0; i < MAX_LOOP_SOURCES && !source; i++)
+        if (!Sources[i].dispatch)
+            source = &Sources[i];
+
+    if (!source) {
+        ERROR("Too many event loop sources\n");
+        return NULL;
+    }
+
+    if (fd >= 0) {
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = source,
+        };
+
+        if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &event)) {
+            ERROR("Couldn't add descriptor %d to the event loop: %s\n", fd, strerror(errno));
+            return NULL;
+        }
+    }
+
+    *source = (LoopSource_t) {
+        .fd = fd,
+        .dispatch = dispatch,
+        .pending = pending,
+        .data = data,
+    };
+
+    return source;
+}
+
+void loop_remove(LoopSource_t * source)
+{
+    if (!source || !source->dispatch)
+        return;
+
+    if (source->fd >= 0)
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    if (source->timer)
+        close(source->fd);
+
+    memset(source, 0, sizeof(*source));
+}
+
+LoopSource_t * loop_add_timer(loop_dispatch_t expire, void * data)
+{
+    LoopSource_t * timer;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        ERROR("Couldn't create a timer: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    timer = loop_add_fd(fd, expire, NULL, data);
+    if (!timer) {
+        close(fd);
+        return NULL;
+    }
+
+    timer->timer = true;
+
+    return timer;
+}
+
+void loop_timer_at(LoopSource_t * timer, uint64_t deadline)
+{
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = deadline / 1000000000ULL,
+            .tv_nsec = deadline % 1000000000ULL,
+        },
+    };
+
+    /* A deadline already past must still fire, which a zero one won't */
+    if (deadline && !spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+        spec.it_value.tv_nsec = 1;
+
+    timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void loop_timer_after(LoopSource_t * timer, uint64_t ns)
+{
+    loop_timer_at(timer, latency_now() + ns);
+}
+
+/* Run a source, unless it was removed by something dispatched before it */
+static void dispatch(LoopSource_t * source)
+{
+    uint64_t expirations;
+
+    if (!source->dispatch)
+        return;
+
+    /* Rearmed or disarmed since it became ready: not expired after all */
+    if (source->timer && read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    source->dispatch(source->data);
+}
+
+int loop_iterate(int timeout_ms)
+{
+    struct epoll_event events[MAX_LOOP_SOURCES];
+    bool ready[MAX_LOOP_SOURCES] = { false };
+    int nready, dispatched = 0;
+
+    for (int i = 0; i < MAX_LOOP_SOURCES; i++)
+        if (Sources[i].pending && Sources[i].pending(Sources[i].data)) {
+            ready[i] = true;
+            timeout_ms = 0;
+        }
+
+    nready = epoll_wait(EpollFd, events, MAX_LOOP_SOURCES, timeout_ms);
+    if (nready < 0 && errno != EINTR) {
+        ERROR("Waiting for events failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < nready; i++)
+        ready[(LoopSource_t *)events[i].data.ptr - Sources] = true;
+
+    /* In source order, and each only once, however it became ready */
+    for (int i = 0; i < MAX_LOOP_SOURCES; i++)
+        if (ready[i]) {
+            dispatch(&Sources[i]);
+            dispatched++;
+        }
+
+    return dispatched;
+}
+
+int loop_run(void)
+{
+    while (ApplicationRunning)
+        if (loop_iterate(-1) < 0)
+            return -1;
+
+    return 0;
+}
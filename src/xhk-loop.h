@@ -0,0 +1,75 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Event loop.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_LOOP_H_
+#define XHK_LOOP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_LOOP_SOURCES 16
+
+typedef void (*loop_dispatch_t)(void * data);
+typedef bool (*loop_pending_t)(void * data);
+
+/* A descriptor, or a timer, waited on by the event loop */
+typedef struct LoopSource_s {
+    int fd;			/* -1 for a source which is only ever pending */
+    bool timer;		/* fd is a timerfd, owned by the loop */
+    loop_dispatch_t dispatch;
+    /*
+     * Optional: whether there is work the descriptor will not signal,
+     * such as events a library has already read into its own queue.
+     * Checked before every wait, which then does not block.
+     */
+    loop_pending_t pending;
+    void * data;
+} LoopSource_t;
+
+int loop_init(void);
+void loop_close(void);
+
+/* Call dispatch whenever fd is readable, or pending returns true */
+LoopSource_t * loop_add_fd(int fd, loop_dispatch_t dispatch, loop_pending_t pending, void * data);
+void loop_remove(LoopSource_t * source);
+
+/*
+ * A timer on CLOCK_MONOTONIC, as latency_now(). It starts disarmed, and
+ * calls expire once for each time it is armed and runs out.
+ */
+LoopSource_t * loop_add_timer(loop_dispatch_t expire, void * data);
+/* Expire at the latency_now() time deadline; 0 disarms */
+void loop_timer_at(LoopSource_t * timer, uint64_t deadline);
+/* Expire ns from now */
+void loop_timer_after(LoopSource_t * timer, uint64_t ns);
+
+/*
+ * Wait up to timeout_ms (-1 forever) for any source, and dispatch every
+ * one which is ready. Returns the number dispatched, or -1 if waiting
+ * failed other than by a signal.
+ */
+int loop_iterate(int timeout_ms);
+
+/* Dispatch events until ApplicationRunning goes false, or waiting fails */
+int loop_run(void);
+
+#endif /* XHK_LOOP_H_ */
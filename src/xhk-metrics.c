@@ -0,0 +1,248 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Live metrics over a Unix socket.
+
+    The socket is one more source in the event loop. A connection is
+    accepted, written the whole exposition at once and closed, without
+    reading anything from it, so a slow or stuck client can never hold up
+    the keyboard: anything it does not take in one non-blocking write is
+    dropped. Every counter read belongs to the event thread, or is
+    atomic, so nothing is locked either.
+
+	socat - UNIX-CONNECT:/run/user/1000/xhk.metrics
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+#include "xhk-metrics.h"
+#include "xhk-predict.h"
+
+/* Latency buckets outside 1us to 2s fold into their neighbours */
+#define METRICS_MIN_NS 1000ULL
+#define METRICS_MAX_NS 2000000000ULL
+
+static struct {
+    char * path;
+    int fd;
+    LoopSource_t * source;
+    XWindowsScreen_t * screen;
+} Metrics = { .fd = -1 };
+
+static void counter(FILE * out, const char * name, const char * help, unsigned long value)
+{
+    fprintf(out, "# HELP xhk_%s %s\n", name, help);
+    fprintf(out, "# TYPE xhk_%s counter\n", name);
+    fprintf(out, "xhk_%s %lu\n", name, value);
+}
+
+static void gauge(FILE * out, const char * name, const char * help, unsigned long value)
+{
+    fprintf(out, "# HELP xhk_%s %s\n", name, help);
+    fprintf(out, "# TYPE xhk_%s gauge\n", name);
+    fprintf(out, "xhk_%s %lu\n", name, value);
+}
+
+static void latency_histograms(FILE * out)
+{
+    fprintf(out, "# HELP xhk_latency_seconds Per-keystroke latency, by stage\n");
+    fprintf(out, "# TYPE xhk_latency_seconds histogram\n");
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+        const char * name = latency_stage_name(stage);
+        uint64_t cumulative = 0;
+
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            uint64_t limit = latency_bucket_limit(bucket);
+
+            cumulative += latency_bucket_count(stage, bucket);
+
+            if (limit < METRICS_MIN_NS)
+                continue;
+            if (limit > METRICS_MAX_NS)
+                break;
+
+            fprintf(out, "xhk_latency_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                    name, (limit + 1) / 1e9, (unsigned long long)cumulative);
+        }
+
+        fprintf(out, "xhk_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                name, (unsigned long long)latency_count(stage));
+        fprintf(out, "xhk_latency_seconds_sum{stage=\"%s\"} %.9f\n", name, latency_sum(stage) / 1e9);
+        fprintf(out, "xhk_latency_seconds_count{stage=\"%s\"} %llu\n",
+                name, (unsigned long long)latency_count(stage));
+    }
+}
+
+void metrics_write(FILE * out, XWindowsScreen_t * screen)
+{
+    XWindowsScreen_t * injector = pipeline_injector(screen);
+    unsigned long injected = statistic(&screen->injected);
+    unsigned long flushes = statistic(&screen->flushes);
+    unsigned long requests = statistic(&screen->requests);
+    EngineStats_t total = { 0 };
+    unsigned long down = 0;
+
+    if (injector) {
+        injected += statistic(&injector->injected);
+        flushes += statistic(&injector->flushes);
+        requests += statistic(&injector->requests);
+    }
+
+    for (int i = 0; i < screen->nkeyboards; i++) {
+        Engine_t * engine = &screen->keyboards[i].engine;
+
+        total.mirrored += engine->stats.mirrored;
+        total.passthrough += engine->stats.passthrough;
+        total.taps += engine->stats.taps;
+        total.holds += engine->stats.holds;
+        total.inversions += engine->stats.inversions;
+
+        for (int keycode = 0; keycode < 256; keycode++)
+            down += engine->keystates[keycode] == KEYSTATE_DOWN;
+    }
+
+    counter(out, "key_events_total", "Key events read from the keyboards", screen->events);
+    counter(out, "keys_injected_total", "Key presses and releases injected", injected);
+    counter(out, "flushes_total", "Flushes of injected keys to the output", flushes);
+    counter(out, "x_requests_total", "X requests sent, as of the last flush", requests);
+    counter(out, "keys_mirrored_total", "Key presses injected mirrored", total.mirrored);
+    counter(out, "keys_passthrough_total", "Key presses injected unmirrored", total.passthrough);
+    counter(out, "space_taps_total", "Modifier presses typed as the key itself", total.taps);
+    counter(out, "space_holds_total", "Modifier presses held to mirror other keys", total.holds);
+    counter(out, "state_inversions_total", "Mirrored keys released after the modifier which mirrored them", total.inversions);
+    counter(out, "words_corrected_total", "Words typed again from the dictionary", predict_corrections());
+    gauge(out, "keys_down", "Keys injected as pressed and not yet released", down);
+    gauge(out, "keyboards", "Keyboards taken over", screen->nkeyboards);
+
+    latency_histograms(out);
+}
+
+/*
+ * The loop never waits for a client to drain, so each is answered with a
+ * single write, into a send buffer made big enough to take all of it.
+ */
+static void metrics_accept(void * data)
+{
+    char * text = NULL;
+    size_t size = 0;
+    ssize_t written;
+    FILE * out;
+    int fd;
+
+    while ((fd = accept4(Metrics.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        out = open_memstream(&text, &size);
+        if (out) {
+            metrics_write(out, Metrics.screen);
+            fclose(out);
+
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(int) { size }, sizeof(int));
+
+            written = write(fd, text, size);
+            if (written != (ssize_t)size)
+                ERROR("Metrics reply fell %zu bytes short of %zu, closing the client: %s\n",
+                      size - (written > 0 ? (size_t)written : 0), size,
+                      written < 0 ? strerror(errno) : "send buffer full");
+
+            free(text);
+            text = NULL;
+        }
+
+        close(fd);
+    }
+}
+
+int metrics_open(const char * path, XWindowsScreen_t * screen)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("Metrics socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    Metrics.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (Metrics.fd < 0) {
+        ERROR("Couldn't create the metrics socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Left behind by an xhk which didn't exit cleanly */
+    if (unlink_socket(path)) {
+        ERROR("Won't replace %s with the metrics socket: %s\n", path, strerror(errno));
+        close(Metrics.fd);
+        Metrics.fd = -1;
+        return -1;
+    }
+
+    /* Only for the user xhk runs as */
+    mask = umask(077);
+    if (bind(Metrics.fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(Metrics.fd, 8)) {
+        ERROR("Couldn't listen on %s: %s\n", path, strerror(errno));
+        umask(mask);
+        close(Metrics.fd);
+        Metrics.fd = -1;
+        return -1;
+    }
+    umask(mask);
+
+    Metrics.source = loop_add_fd(Metrics.fd, metrics_accept, NULL, NULL);
+    if (!Metrics.source) {
+        metrics_close();
+        return -1;
+    }
+
+    Metrics.path = strdup(path);
+    Metrics.screen = screen;
+
+    INFO("Serving metrics on %s\n", path);
+
+    return 0;
+}
+
+void metrics_close(void)
+{
+    loop_remove(Metrics.source);
+    Metrics.source = NULL;
+
+    if (Metrics.fd >= 0) {
+        close(Metrics.fd);
+        if (Metrics.path)
+            unlink_socket(Metrics.path);
+    }
+    Metrics.fd = -1;
+
+    free(Metrics.path);
+    Metrics.path = NULL;
+    Metrics.screen = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Live metrics over a Unix socket.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_METRICS_H_
+#define XHK_METRICS_H_
+
+#include <stdio.h>
+
+#include "xhk.h"
+
+/*
+ * Listen on a Unix socket at path, served by the event loop. Each
+ * connection is sent the screen's metrics in the Prometheus text format,
+ * then closed.
+ */
+int metrics_open(const char * path, XWindowsScreen_t * screen);
+void metrics_close(void);
+
+/* Write the metrics out, as a connection is sent them */
+void metrics_write(FILE * out, XWindowsScreen_t * screen);
+
+#endif /* XHK_METRICS_H_ */
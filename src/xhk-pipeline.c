@@ -0,0 +1,218 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Pipelined injection.
+
+    The event thread reads keys and runs them through the engines, then
+    hands the keys to inject through a single producer, single consumer
+    ring to an injector thread, which writes them to the server over a
+    connection of its own. A slow write to a busy server then only holds
+    up the injector, never the reading of the next physical key.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "xhk.h"
+#include "xhk-trace.h"
+
+#define CACHE_LINE 64
+#define RING_SIZE  256	/* a power of two */
+#define RING_MASK  (RING_SIZE - 1)
+
+/*
+ * Each side's index lives on a cache line of its own, next to that side's
+ * cached copy of the other index, so that neither side writes to a line
+ * the other is reading until there is something to say.
+ */
+static struct {
+    /* Producer: the event thread */
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    size_t tail_cache;
+    unsigned long pushes;
+    unsigned long stalls;	/* pushes which found the ring full */
+    unsigned long occupancy;	/* summed over pushes, for the mean */
+    unsigned long occupancy_max;
+
+    /* Consumer: the injector thread */
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
+
+    _Alignas(CACHE_LINE) Injection_t entries[RING_SIZE];
+
+    sem_t ready;
+    atomic_bool stop;
+    pthread_t thread;
+    XWindowsScreen_t * injector;
+} Ring;
+
+static void ring_push(const Injection_t * entry)
+{
+    size_t head = atomic_load_explicit(&Ring.head, memory_order_relaxed);
+    size_t used = head - Ring.tail_cache;
+
+    if (used == RING_SIZE) {
+        Ring.tail_cache = atomic_load_explicit(&Ring.tail, memory_order_acquire);
+        used = head - Ring.tail_cache;
+
+        if (used == RING_SIZE) {
+            Ring.stalls++;
+            TRACE(RING_STALL, RING_SIZE, 0, 0, 0);
+
+            /* Make sure the injector is awake, and let it run */
+            sem_post(&Ring.ready);
+            do {
+                sched_yield();
+                Ring.tail_cache = atomic_load_explicit(&Ring.tail, memory_order_acquire);
+            } while (head - Ring.tail_cache == RING_SIZE);
+
+            used = head - Ring.tail_cache;
+        }
+    }
+
+    Ring.entries[head & RING_MASK] = *entry;
+    atomic_store_explicit(&Ring.head, head + 1, memory_order_release);
+
+    Ring.pushes++;
+    Ring.occupancy += used + 1;
+    if (used + 1 > Ring.occupancy_max)
+        Ring.occupancy_max = used + 1;
+}
+
+static bool ring_pop(Injection_t * entry)
+{
+    size_t tail = atomic_load_explicit(&Ring.tail, memory_order_relaxed);
+
+    if (tail == Ring.head_cache) {
+        Ring.head_cache = atomic_load_explicit(&Ring.head, memory_order_acquire);
+        if (tail == Ring.head_cache)
+            return false;
+    }
+
+    *entry = Ring.entries[tail & RING_MASK];
+    atomic_store_explicit(&Ring.tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+/* Called by FlushKeys() on the event thread: pass the whole queue on */
+void pipeline_push(XWindowsScreen_t * screen)
+{
+    for (int i = 0; i < screen->inject_count; i++)
+        ring_push(&screen->inject[i]);
+
+    screen->inject_count = 0;
+
+    sem_post(&Ring.ready);
+}
+
+/*
+ * Drain the ring into the injector's own queue, and flush that whenever
+ * it fills or the ring runs dry: one flush per batch, as on a single
+ * thread.
+ */
+static void * injector_thread(void * data)
+{
+    XWindowsScreen_t * injector = data;
+    Injection_t entry;
+
+    trace_thread(TRACE_THREAD_INJECTOR);
+
+    for (;;) {
+        while (sem_wait(&Ring.ready) && errno == EINTR)
+            ;
+
+        while (ring_pop(&entry)) {
+            injector->inject[injector->inject_count++] = entry;
+            if (injector->inject_count == INJECT_QUEUE_SIZE)
+                FlushKeys(injector);
+        }
+
+        FlushKeys(injector);
+
+        if (atomic_load(&Ring.stop)) {
+            /* Anything pushed before we were stopped has been drained */
+            if (atomic_load(&Ring.head) == atomic_load(&Ring.tail))
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+int pipeline_start(XWindowsScreen_t * screen, XWindowsScreen_t * injector)
+{
+    sigset_t all, old;
+    int err;
+
+    memset(&Ring, 0, sizeof(Ring));
+    sem_init(&Ring.ready, 0, 0);
+    Ring.injector = injector;
+
+    /* Signals are for the event thread, whose blocking read they interrupt */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&Ring.thread, NULL, injector_thread, injector);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        ERROR("Couldn't start the injector thread: %s\n", strerror(err));
+        sem_destroy(&Ring.ready);
+        return -1;
+    }
+
+    INFO("Injecting through %s from a thread of its own\n", injector->io->name);
+
+    screen->pipelined = true;
+
+    return 0;
+}
+
+XWindowsScreen_t * pipeline_injector(XWindowsScreen_t * screen)
+{
+    return screen->pipelined ? Ring.injector : NULL;
+}
+
+void pipeline_stop(XWindowsScreen_t * screen)
+{
+    if (!screen->pipelined)
+        return;
+
+    FlushKeys(screen);
+
+    atomic_store(&Ring.stop, true);
+    sem_post(&Ring.ready);
+    pthread_join(Ring.thread, NULL);
+    sem_destroy(&Ring.ready);
+
+    screen->pipelined = false;
+    statistic_add(&screen->injected, statistic(&Ring.injector->injected));
+    statistic_add(&screen->flushes, statistic(&Ring.injector->flushes));
+    statistic_add(&screen->requests, statistic(&Ring.injector->requests));
+
+    REPORT("Pipeline: %lu keys through a ring of %d, mean occupancy %.2f, max %lu, %lu stalls\n",
+           Ring.pushes, RING_SIZE,
+           Ring.pushes ? (double)Ring.occupancy / Ring.pushes : 0.0,
+           Ring.occupancy_max, Ring.stalls);
+}
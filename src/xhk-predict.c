@@ -0,0 +1,291 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Predictive mode: each key stands for itself or its mirror, and words
+    are resolved against a dictionary as they are finished.
+
+    Letters are injected as they are typed, so the typist sees the word
+    grow as usual. A letter typed with the modifier held is taken as
+    meant; any other letter may also be its mirror. When the word ends,
+    at a space, return or punctuation, the dictionary is searched for the
+    most frequent word fitting the keys, and if that differs from what
+    was typed, backspaces and the rest of the word are injected ahead of
+    the key which ended it, all in one batch. A word touched by any other
+    key, Shift included, is left as it is.
+
+    The dictionary is mapped, not read: a trie compiled by xhk-dictc,
+    checked once and then searched in place, without allocating.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <X11/keysym.h>
+
+#include "xhk.h"
+#include "xhk-keymap.h"
+#include "xhk-latency.h"
+#include "xhk-layout.h"
+#include "xhk-predict.h"
+#include "xhk-trace.h"
+
+enum predict_class {
+    PREDICT_OTHER,
+    PREDICT_LETTER,
+    PREDICT_BOUNDARY,
+    PREDICT_ERASE,
+};
+
+static struct {
+    Dict_t dict;
+    bool loaded;
+    void * map;
+    size_t size;
+
+    unsigned long corrections;
+} Predict;
+
+/* The US layout on the standard pc105 keycodes, for keys without a keysym */
+static const struct {
+    int keycode;
+    const char * keys;
+} Qwerty[] = {
+    { 10, "1234567890-=" },
+    { 24, "qwertyuiop[]" },
+    { 38, "asdfghjkl;'`" },
+    { 51, "\\zxcvbnm,./" },
+};
+
+static KeySym keysym_of(int keycode)
+{
+    KeySym keysym = keymap_keysym(keycode);
+
+    if (keysym != NoSymbol)
+        return keysym;
+
+    /* No keymap, as for evdev and replay */
+    for (size_t row = 0; row < sizeof(Qwerty) / sizeof(Qwerty[0]); row++)
+        if (keycode >= Qwerty[row].keycode
+                && keycode < Qwerty[row].keycode + (int)strlen(Qwerty[row].keys))
+            return Qwerty[row].keys[keycode - Qwerty[row].keycode];
+
+    switch (keycode) {
+    case KEY_BACKSPACE: return XK_BackSpace;
+    case KEY_TAB:       return XK_Tab;
+    case KEY_ENTER:     return XK_Return;
+    case KEY_SPACE:     return XK_space;
+    }
+
+    return NoSymbol;
+}
+
+static enum predict_class classify(int keycode, char * letter)
+{
+    KeySym keysym = keysym_of(keycode);
+
+    if (keysym >= XK_a && keysym <= XK_z) {
+        *letter = keysym;
+        return PREDICT_LETTER;
+    }
+
+    if (keysym == XK_BackSpace)
+        return PREDICT_ERASE;
+
+    /* Space, digits and punctuation */
+    if ((keysym >= XK_space && keysym <= XK_asciitilde) || keysym == XK_Return
+            || keysym == XK_KP_Enter || keysym == XK_Tab)
+        return PREDICT_BOUNDARY;
+
+    return PREDICT_OTHER;
+}
+
+int predict_load(const void * image, size_t size)
+{
+    if (dict_load(&Predict.dict, image, size))
+        return -1;
+
+    Predict.loaded = true;
+
+    return 0;
+}
+
+int predict_open(const char * path)
+{
+    uint64_t start = latency_now();
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st)) {
+        ERROR("Couldn't open dictionary %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    Predict.size = st.st_size;
+    Predict.map = mmap(NULL, Predict.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (Predict.map == MAP_FAILED) {
+        ERROR("Couldn't map dictionary %s: %s\n", path, strerror(errno));
+        Predict.map = NULL;
+        return -1;
+    }
+
+    if (predict_load(Predict.map, Predict.size)) {
+        ERROR("%s is not an xhk dictionary, or is damaged\n", path);
+        predict_close();
+        return -1;
+    }
+
+    INFO("Dictionary %s: %u words, mapped in %.3f ms\n", path, Predict.dict.header->words,
+         (latency_now() - start) / 1e6);
+
+    return 0;
+}
+
+void predict_close(void)
+{
+    if (Predict.map)
+        munmap(Predict.map, Predict.size);
+
+    memset(&Predict, 0, sizeof(Predict));
+}
+
+unsigned long predict_corrections(void)
+{
+    return Predict.corrections;
+}
+
+static void add_letter(PredictWord_t * word, const EngineTable_t * table, const Action_t * action, char letter)
+{
+    DictKey_t * key = &word->keys[word->length];
+    int mirror = table->layers[0].map[action->keycode];
+    char other;
+
+    if (word->length == DICT_MAX_WORD) {
+        word->abandoned = true;
+        return;
+    }
+
+    *key = (DictKey_t) { .letters = { letter }, .choices = 1 };
+    word->keycodes[word->length][0] = action->keycode;
+
+    /* Typed through a layer, the letter is exactly as meant */
+    if (!action->mapped && mirror != action->keycode
+            && classify(mirror, &other) == PREDICT_LETTER) {
+        key->letters[1] = other;
+        key->choices = 2;
+        word->keycodes[word->length][1] = mirror;
+    }
+
+    word->length++;
+}
+
+static inline void tap(Action_t * actions, int * n, int keycode)
+{
+    actions[(*n)++] = (Action_t) { .keycode = keycode, .key_down = true };
+    actions[(*n)++] = (Action_t) { .keycode = keycode, .key_down = false };
+}
+
+/* The word has ended: type it again if the dictionary prefers other letters */
+static void finish_word(PredictWord_t * word, Action_t * actions, int * n)
+{
+    int32_t choice;
+    int backspace, first;
+
+    if (word->length && !word->abandoned) {
+        choice = dict_best(&Predict.dict, word->keys, word->length);
+
+        /* 0 is the word as typed */
+        if (choice > 0) {
+            backspace = keymap_keycode(XK_BackSpace);
+            if (!backspace)
+                backspace = KEY_BACKSPACE;
+
+            /* Everything from the first letter which changes */
+            first = ffs(choice) - 1;
+
+            for (int i = first; i < word->length; i++)
+                tap(actions, n, backspace);
+            for (int i = first; i < word->length; i++)
+                tap(actions, n, word->keycodes[i][(choice >> i) & 1]);
+
+            Predict.corrections++;
+            TRACE(PREDICT, word->length, choice, 0, 0);
+        }
+    }
+
+    word->length = 0;
+    word->abandoned = false;
+}
+
+int predict_keys(PredictWord_t * word, const EngineTable_t * table,
+                 Action_t actions[PREDICT_MAX_ACTIONS], int count)
+{
+    Action_t keys[ENGINE_MAX_ACTIONS];
+    char letter;
+    int n = 0;
+
+    if (!Predict.loaded)
+        return count;
+
+    /* Whatever is typed meanwhile isn't ours to correct */
+    if (!table->enabled) {
+        word->abandoned = true;
+        return count;
+    }
+
+    memcpy(keys, actions, count * sizeof(*keys));
+
+    for (int i = 0; i < count; i++) {
+        if (keys[i].key_down) {
+            switch (classify(keys[i].keycode, &letter)) {
+            case PREDICT_LETTER:
+                add_letter(word, table, &keys[i], letter);
+                break;
+            case PREDICT_ERASE:
+                /* Past the start of the word is editing something else */
+                if (word->length)
+                    word->length--;
+                else
+                    word->abandoned = true;
+                break;
+            case PREDICT_BOUNDARY:
+                finish_word(word, actions, &n);
+                break;
+            case PREDICT_OTHER:
+                word->abandoned = true;
+                break;
+            }
+        }
+
+        actions[n++] = keys[i];
+    }
+
+    return n;
+}
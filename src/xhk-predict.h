@@ -0,0 +1,63 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Predictive mode: each key stands for itself or its mirror, and words
+    are resolved against a dictionary as they are finished.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef XHK_PREDICT_H_
+#define XHK_PREDICT_H_
+
+#include <stddef.h>
+
+#include "xhk-dict.h"
+#include "xhk-engine.h"
+
+/* The word being typed on one keyboard, and the keycodes of its letters */
+typedef struct PredictWord_s {
+    DictKey_t keys[DICT_MAX_WORD];
+    uint8_t keycodes[DICT_MAX_WORD][2];
+    int length;
+    bool abandoned;
+} PredictWord_t;
+
+/* A whole word taken back and typed again, and the keys which ended it */
+#define PREDICT_MAX_ACTIONS (4 * DICT_MAX_WORD + ENGINE_MAX_ACTIONS)
+
+/* Map a dictionary compiled by xhk-dictc, which is used as it is */
+int predict_open(const char * path);
+void predict_close(void);
+/* Use a dictionary image already in memory, which must outlive its use */
+int predict_load(const void * image, size_t size);
+
+/*
+ * Follow the keys an engine is about to inject, as typed into the word
+ * of the keyboard they came from. At the end of a word,
+ * when the dictionary prefers other letters for the keys typed, the
+ * keys to take the word back and type it again are put first. Returns
+ * the new number of actions.
+ */
+int predict_keys(PredictWord_t * word, const EngineTable_t * table,
+                 Action_t actions[PREDICT_MAX_ACTIONS], int count);
+
+/* The number of words corrected */
+unsigned long predict_corrections(void);
+
+#endif /* XHK_PREDICT_H_ */
@@ -0,0 +1,205 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Real time scheduling, memory locking and CPU pinning.
+
+    setpriority() alone leaves the event thread to CFS, free to migrate
+    between CPUs, and open to page faults on memory it has not touched
+    for a while; all of which show up as stalled keystrokes when the
+    machine is busy. Here the thread is made SCHED_FIFO and its memory
+    locked in place, before any keys are handled.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <malloc.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-realtime.h"
+
+/* Enough for the deepest call chain through Xlib or XCB */
+#define PREFAULT_STACK (256 * 1024)
+/* Enough for every allocation made while handling events */
+#define PREFAULT_HEAP  (1024 * 1024)
+
+static void step(const char * what, int err, int * failed)
+{
+    if (err) {
+        REPORT("  %-28s failed: %s\n", what, strerror(err));
+        (*failed)++;
+    } else
+        REPORT("  %-28s ok\n", what);
+}
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    volatile unsigned char stack[PREFAULT_STACK];
+
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+static int prefault_heap(void)
+{
+    char * heap;
+
+    /* Keep freed memory in the heap, rather than handing it back */
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0))
+        return EINVAL;
+
+    heap = malloc(PREFAULT_HEAP);
+    if (!heap)
+        return ENOMEM;
+
+    memset(heap, 0, PREFAULT_HEAP);
+    free(heap);
+
+    return 0;
+}
+
+int realtime_setup(int priority, int cpu)
+{
+    struct sched_param param = { .sched_priority = priority };
+    char what[64];
+    int failed = 0;
+
+    REPORT("Real time mode:\n");
+
+    snprintf(what, sizeof(what), "SCHED_FIFO priority %d", priority);
+    step(what, sched_setscheduler(0, SCHED_FIFO, &param) ? errno : 0, &failed);
+
+    step("mlockall", mlockall(MCL_CURRENT | MCL_FUTURE) ? errno : 0, &failed);
+
+    /* With the memory locked, touching it once keeps it resident */
+    prefault_stack();
+    step("prefault stack", 0, &failed);
+    step("prefault heap", prefault_heap(), &failed);
+
+    if (cpu != REALTIME_NO_CPU) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        snprintf(what, sizeof(what), "pin to CPU %d", cpu);
+        step(what, sched_setaffinity(0, sizeof(set), &set) ? errno : 0, &failed);
+    }
+
+    return failed;
+}
+
+/*
+ * Jitter: how late a periodic timer wakes us, which is the delay a key
+ * event would see between arriving and xhk being run to handle it.
+ */
+#define JITTER_PERIOD 1000000ULL	/* 1ms */
+
+static int compare(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void jitter_run(const char * mode, uint64_t * samples, size_t count)
+{
+    uint64_t next = latency_now() + JITTER_PERIOD;
+
+    for (size_t i = 0; i < count; i++) {
+        struct timespec ts = {
+            .tv_sec = next / 1000000000ULL,
+            .tv_nsec = next % 1000000000ULL,
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        samples[i] = latency_now() - next;
+        next += JITTER_PERIOD;
+    }
+
+    qsort(samples, count, sizeof(*samples), compare);
+
+    printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", mode,
+           samples[count / 2] / 1e3,
+           samples[count * 99 / 100] / 1e3,
+           samples[count * 999 / 1000] / 1e3,
+           samples[count - 1] / 1e3);
+}
+
+int realtime_jitter(int seconds, int priority, int cpu)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = seconds * (1000000000ULL / JITTER_PERIOD);
+    uint64_t * samples;
+    pid_t * load;
+
+    if (count == 0 || cpus < 1)
+        return -1;
+
+    samples = malloc(count * sizeof(*samples));
+    load = calloc(cpus, sizeof(*load));
+    if (!samples || !load) {
+        free(samples);
+        free(load);
+        return -1;
+    }
+
+    /* One spinning process per CPU, at normal priority */
+    for (long i = 0; i < cpus; i++) {
+        load[i] = fork();
+        if (load[i] == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            setpriority(PRIO_PROCESS, 0, 0);
+            for (;;)
+                ;
+        }
+    }
+
+    REPORT("Timer wakeup jitter over %d seconds per mode, with %ld CPU load processes\n", seconds, cpus);
+    printf("%-10s %10s %10s %10s %10s\n", "jitter/us", "p50", "p99", "p999", "max");
+
+    jitter_run("plain", samples, count);
+
+    realtime_setup(priority, cpu);
+
+    jitter_run("realtime", samples, count);
+
+    for (long i = 0; i < cpus; i++)
+        if (load[i] > 0) {
+            kill(load[i], SIGKILL);
+            waitpid(load[i], NULL, 0);
+        }
+
+    free(samples);
+    free(load);
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Real time scheduling, memory locking and CPU pinning.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_REALTIME_H_
+#define XHK_REALTIME_H_
+
+#define REALTIME_DEFAULT_PRIORITY 50
+#define REALTIME_NO_CPU (-1)
+
+/*
+ * Make the calling thread real time: SCHED_FIFO at priority, all memory
+ * locked and prefaulted, and if cpu is not REALTIME_NO_CPU, pinned to it.
+ * Each step is reported, and the number which failed returned.
+ */
+int realtime_setup(int priority, int cpu);
+
+/*
+ * Measure timer wakeup jitter for the given number of seconds, with every
+ * CPU kept busy by a competing process: first with normal scheduling,
+ * then after realtime_setup(priority, cpu).
+ */
+int realtime_jitter(int seconds, int priority, int cpu);
+
+#endif /* XHK_REALTIME_H_ */
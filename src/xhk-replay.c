@@ -0,0 +1,317 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Recording and replay of key event streams.
+
+    A recording is the key events exactly as the backend delivered them to
+    handle_key_press() and handle_key_release(). Replaying one pushes those
+    events through the same path with no display attached, writing the
+    injected keys to a text stream that can be diffed between versions.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+
+#define RECORD_MAGIC "XHKR"
+#define RECORD_VERSION 2
+
+/*
+ * Version 1 recordings began with just "XHK1", and their records had no
+ * device. Where the device now sits they held zero, which is the device
+ * every version 1 event was replayed on, so they still read as they are.
+ */
+#define RECORD_MAGIC_V1 "XHK1"
+
+#define RECORD_KEY_DOWN (1 << 0)
+#define RECORD_REPEAT   (1 << 1)
+
+/* On disk: this header, followed by one Record_t per event */
+typedef struct RecordHeader_s {
+    char     magic[4];
+    uint32_t version;
+} RecordHeader_t;
+
+typedef struct Record_s {
+    uint32_t time;	/* device timestamp, milliseconds */
+    uint8_t  keycode;
+    uint8_t  flags;
+    uint16_t deviceid;	/* the keyboard it came from, so replay keeps them apart */
+} Record_t;
+
+static FILE * record_file;
+
+int record_open(const char * path)
+{
+    RecordHeader_t header = { .magic = RECORD_MAGIC, .version = RECORD_VERSION };
+
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        ERROR("Couldn't create recording %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fwrite(&header, sizeof(header), 1, record_file);
+
+    return 0;
+}
+
+void record_event(KeyEvent_t * event, bool key_down)
+{
+    Record_t record = {
+        .time = event->time,
+        .keycode = event->keycode,
+        .deviceid = event->deviceid,
+        .flags = (key_down ? RECORD_KEY_DOWN : 0) | (event->repeat ? RECORD_REPEAT : 0),
+    };
+
+    if (record_file)
+        fwrite(&record, sizeof(record), 1, record_file);
+}
+
+void record_close(void)
+{
+    if (record_file && fclose(record_file))
+        ERROR("Writing recording failed: %s\n", strerror(errno));
+
+    record_file = NULL;
+}
+
+/*
+ * Replay. The whole recording is loaded up front, so that reading it is
+ * not part of what is measured.
+ */
+#define REPLAY_BATCH 64
+
+static struct {
+    Record_t * records;
+    size_t count;
+    size_t next;
+    bool paced;
+    FILE * output;
+
+    uint64_t start;	/* latency_now() at the first event */
+    uint32_t first;	/* time of the first recorded event */
+
+    /* Paced: a timer for the next event, else always pending */
+    LoopSource_t * source;
+} Replay;
+
+/* When the next event is due, at its recorded offset from the first */
+static uint64_t next_deadline(void)
+{
+    uint32_t offset = Replay.records[Replay.next].time - Replay.first;
+
+    return Replay.start + offset * 1000000ULL;
+}
+
+static void replay_dispatch(void * data)
+{
+    XWindowsScreen_t * screen = data;
+    size_t end = Replay.next + REPLAY_BATCH;
+
+    if (end > Replay.count)
+        end = Replay.count;
+
+    /* One event at a time, each at its recorded offset */
+    if (Replay.paced && Replay.next < end)
+        end = Replay.next + 1;
+
+    for (; Replay.next < end; Replay.next++) {
+        Record_t * record = &Replay.records[Replay.next];
+        KeyEvent_t key = {
+            .deviceid = record->deviceid,
+            .keycode = record->keycode,
+            .repeat = (record->flags & RECORD_REPEAT) != 0,
+            .time = record->time,
+            .received = latency_now(),
+        };
+
+        if (record->flags & RECORD_KEY_DOWN)
+            handle_key_press(screen, &key);
+        else
+            handle_key_release(screen, &key);
+    }
+
+    FlushKeys(screen);
+
+    if (Replay.next == Replay.count)
+        ApplicationRunning = false;
+    else if (Replay.paced)
+        loop_timer_at(Replay.source, next_deadline());
+}
+
+static bool replay_pending(void * data)
+{
+    return Replay.next < Replay.count;
+}
+
+static int replay_attach(XWindowsScreen_t * screen)
+{
+    Replay.start = latency_now();
+    Replay.first = Replay.count ? Replay.records[0].time : 0;
+
+    /* Nothing to replay */
+    if (!Replay.count)
+        ApplicationRunning = false;
+
+    if (!Replay.paced) {
+        Replay.source = loop_add_fd(-1, replay_dispatch, replay_pending, screen);
+        return Replay.source ? 0 : -1;
+    }
+
+    Replay.source = loop_add_timer(replay_dispatch, screen);
+    if (!Replay.source)
+        return -1;
+
+    if (Replay.count)
+        loop_timer_at(Replay.source, next_deadline());
+
+    return 0;
+}
+
+static int replay_fake_key(XWindowsScreen_t * screen, int keycode, bool key_down)
+{
+    if (Replay.output)
+        fprintf(Replay.output, "%3d %s\n", keycode, key_down ? "down" : "up");
+
+    return 1;
+}
+
+static void replay_flush(XWindowsScreen_t * screen)
+{
+}
+
+static void replay_close(XWindowsScreen_t * screen)
+{
+    double elapsed = (latency_now() - Replay.start) / 1e9;
+
+    loop_remove(Replay.source);
+    Replay.source = NULL;
+
+    REPORT("Replayed %zu events in %.3f seconds: %.0f events/s, %.1f ns/event\n",
+           Replay.next, elapsed,
+           elapsed > 0 ? Replay.next / elapsed : 0.0,
+           Replay.next ? elapsed * 1e9 / Replay.next : 0.0);
+
+    if (Replay.output && Replay.output != stdout)
+        fclose(Replay.output);
+
+    free(Replay.records);
+    Replay.records = NULL;
+
+    screen->io = NULL;
+}
+
+static const struct xhk_io replay_io = {
+    .name = "replay",
+    .attach = replay_attach,
+    .fake_key = replay_fake_key,
+    .flush = replay_flush,
+    .close = replay_close,
+};
+
+/* Each keyboard in the recording gets an engine of its own, as it had live */
+static void add_replay_keyboards(XWindowsScreen_t * screen, const char * path)
+{
+    for (size_t i = 0; i < Replay.count; i++) {
+        int deviceid = Replay.records[i].deviceid;
+        bool known = false;
+
+        for (int k = 0; k < screen->nkeyboards; k++)
+            known |= screen->keyboards[k].deviceid == deviceid;
+
+        if (!known && !add_keyboard(screen, deviceid, 0, path))
+            return;
+    }
+}
+
+int replay_io_open(XWindowsScreen_t * screen, const char * path, bool paced, const char * output)
+{
+    RecordHeader_t header;
+    long start, size;
+    FILE * fp;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        ERROR("Couldn't open recording %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(header.magic, 4, 1, fp) == 1 && memcmp(header.magic, RECORD_MAGIC_V1, 4) == 0) {
+        header.version = 1;
+        start = 4;
+    } else if (fseek(fp, 0, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, fp) == 1
+               && memcmp(header.magic, RECORD_MAGIC, 4) == 0) {
+        start = sizeof(header);
+    } else {
+        ERROR("%s is not an xhk recording\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    if (header.version > RECORD_VERSION) {
+        ERROR("%s is a version %u recording, newer than this xhk reads\n", path, header.version);
+        fclose(fp);
+        return -1;
+    }
+
+    if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < start || fseek(fp, start, SEEK_SET)) {
+        ERROR("Couldn't read recording %s: %s\n", path, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+
+    Replay.count = (size - start) / sizeof(Record_t);
+    Replay.records = malloc(Replay.count * sizeof(Record_t) + 1);
+    if (!Replay.records || fread(Replay.records, sizeof(Record_t), Replay.count, fp) != Replay.count) {
+        ERROR("Couldn't read recording %s\n", path);
+        free(Replay.records);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    Replay.next = 0;
+    Replay.paced = paced;
+    Replay.output = NULL;
+
+    if (output) {
+        Replay.output = strcmp(output, "-") ? fopen(output, "w") : stdout;
+        if (!Replay.output) {
+            ERROR("Couldn't create %s: %s\n", output, strerror(errno));
+            free(Replay.records);
+            return -1;
+        }
+    }
+
+    INFO("Replaying %zu events from %s%s\n", Replay.count, path, paced ? " at recorded timing" : "");
+
+    add_replay_keyboards(screen, path);
+
+    screen->io = &replay_io;
+
+    return 0;
+}
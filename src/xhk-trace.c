@@ -0,0 +1,146 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Binary trace ring.
+
+    Trace points write fixed size binary records into a ring in memory,
+    at the cost of a few nanoseconds and no system calls. Nothing is
+    formatted until xhk-tracedump reads the trace back, offline.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xhk.h"
+#include "xhk-latency.h"
+#include "xhk-trace.h"
+
+__thread TraceRing_t * TraceRing;
+
+static struct {
+    TraceRing_t rings[TRACE_THREADS];
+    bool open;
+    const char * path;
+    void * base;
+    size_t size;
+    bool mapped;
+} Trace;
+
+/* Pair up the trace clock with CLOCK_MONOTONIC, for the decoder */
+static void calibrate(TraceHeader_t * header, int point)
+{
+    header->ticks[point] = trace_clock();
+    header->ns[point] = latency_now();
+}
+
+int trace_open(const char * path, uint64_t records, bool mmap_file)
+{
+    TraceHeader_t * header;
+    int fd = -1;
+
+    if (records == 0 || (records & (records - 1))) {
+        ERROR("Trace size must be a power of two\n");
+        return -1;
+    }
+
+    Trace.size = sizeof(TraceHeader_t) + TRACE_THREADS * records * sizeof(TraceRecord_t);
+
+    if (mmap_file) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, Trace.size)) {
+            ERROR("Couldn't create trace %s: %s\n", path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+
+        Trace.base = mmap(NULL, Trace.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else
+        Trace.base = mmap(NULL, Trace.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (Trace.base == MAP_FAILED) {
+        ERROR("Couldn't map the trace ring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Fault the ring in now, not on the first trace point to reach a page */
+    memset(Trace.base, 0, Trace.size);
+
+    header = Trace.base;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(TraceRecord_t);
+    header->threads = TRACE_THREADS;
+    header->records = records;
+
+    /* Enough of a calibration for a trace cut short, refined on close */
+    calibrate(header, 0);
+    do
+        calibrate(header, 1);
+    while (header->ns[1] - header->ns[0] < 10000000);
+
+    for (int thread = 0; thread < TRACE_THREADS; thread++) {
+        Trace.rings[thread].head = &header->head[thread];
+        Trace.rings[thread].records = (TraceRecord_t *)(header + 1) + thread * records;
+        Trace.rings[thread].mask = records - 1;
+    }
+    Trace.path = path;
+    Trace.mapped = mmap_file;
+    Trace.open = true;
+
+    trace_thread(TRACE_THREAD_EVENT);
+
+    INFO("Tracing %lu records to %s%s\n", (unsigned long)records, path, mmap_file ? ", mapped" : "");
+
+    return 0;
+}
+
+void trace_thread(enum trace_thread thread)
+{
+    if (Trace.open)
+        TraceRing = &Trace.rings[thread];
+}
+
+/* Every other thread has stopped by now */
+void trace_close(void)
+{
+    FILE * fp;
+
+    if (!Trace.open)
+        return;
+
+    TraceRing = NULL;
+    Trace.open = false;
+    calibrate(Trace.base, 1);
+
+    if (!Trace.mapped) {
+        fp = fopen(Trace.path, "wb");
+        if (!fp || fwrite(Trace.base, Trace.size, 1, fp) != 1)
+            ERROR("Couldn't write trace %s: %s\n", Trace.path, strerror(errno));
+        if (fp)
+            fclose(fp);
+    }
+
+    munmap(Trace.base, Trace.size);
+}
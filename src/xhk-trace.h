@@ -0,0 +1,173 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Binary trace ring.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_TRACE_H_
+#define XHK_TRACE_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Trace points at a level above XHK_TRACE_LEVEL are compiled out
+ * entirely. Configure with --enable-trace=LEVEL to choose.
+ */
+#ifndef XHK_TRACE_LEVEL
+#define XHK_TRACE_LEVEL 2
+#endif
+
+/*
+ * Every trace event: its name, level, and how xhk-tracedump prints its
+ * four arguments. %k prints a key, %d down or up, %u and %x a number.
+ */
+#define XHK_TRACE_EVENTS(EVENT)						\
+    EVENT(KEY_IN,     1, "key %k %d from device %u, repeat %u")	\
+    EVENT(KEY_OUT,    1, "inject %k %d")				\
+    EVENT(ENGINE,     2, "engine %k gave %u keys, layer states %x")	\
+    EVENT(FLUSH,      1, "flush %u keys")				\
+    EVENT(FOCUS,      2, "focus window 0x%x")				\
+    EVENT(RING_STALL, 2, "injector ring full, %u keys")		\
+    EVENT(RELOAD,     1, "configuration reloaded")			\
+    EVENT(KEYMAP,     1, "keymap read, %u keycodes bound, build %u")	\
+    EVENT(CONTROL,    1, "control command, enabled %u, mirror %u")	\
+    EVENT(PREDICT,    1, "word of %u letters typed again, choices %x")	\
+    EVENT(HOTPLUG,    1, "keyboard device %u, present %u")
+
+#define TRACE_ENUM(name, level, format) TRACE_##name,
+enum trace_event {
+    XHK_TRACE_EVENTS(TRACE_ENUM)
+    TRACE_EVENTS,
+};
+#undef TRACE_ENUM
+
+#define TRACE_LEVEL_ENUM(name, level, format) TRACE_LEVEL_##name = level,
+enum trace_level {
+    XHK_TRACE_EVENTS(TRACE_LEVEL_ENUM)
+};
+#undef TRACE_LEVEL_ENUM
+
+/* One record, two to a cache line */
+typedef struct TraceRecord_s {
+    uint64_t time;		/* trace_clock() ticks */
+    _Atomic uint32_t seq;	/* position in the trace + 1, written last */
+    uint16_t event;
+    uint16_t reserved;
+    uint32_t arg[4];
+} TraceRecord_t;
+
+/*
+ * Each thread traces into a ring of its own, so that no trace point ever
+ * needs a locked instruction. The decoder merges them by time.
+ */
+enum trace_thread {
+    TRACE_THREAD_EVENT,
+    TRACE_THREAD_INJECTOR,
+    TRACE_THREAD_CONFIG,
+    TRACE_THREADS,
+};
+
+#define TRACE_MAGIC "XHKTRACE"
+#define TRACE_VERSION 1
+
+/* The start of a trace file, followed by each thread's ring of records */
+typedef struct TraceHeader_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t threads;
+    uint32_t reserved;
+    uint64_t records;		/* capacity of each ring, a power of two */
+    _Atomic uint64_t head[TRACE_THREADS];	/* records ever written */
+
+    /* trace_clock() and CLOCK_MONOTONIC ns, read together at two times */
+    uint64_t ticks[2];
+    uint64_t ns[2];
+} TraceHeader_t;
+
+typedef struct TraceRing_s {
+    _Atomic uint64_t * head;
+    TraceRecord_t * records;
+    uint64_t mask;
+} TraceRing_t;
+
+/* The calling thread's ring, or NULL when it is not tracing */
+extern __thread TraceRing_t * TraceRing;
+
+/* The cheapest monotonic clock there is: the TSC on x86 */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_record(enum trace_event event, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    TraceRing_t * ring = TraceRing;
+    TraceRecord_t * record;
+    uint64_t seq;
+
+    if (!ring)
+        return;
+
+    /* Nobody else writes to this ring */
+    seq = atomic_load_explicit(ring->head, memory_order_relaxed);
+    record = &ring->records[seq & ring->mask];
+
+    record->time = trace_clock();
+    record->event = event;
+    record->arg[0] = a;
+    record->arg[1] = b;
+    record->arg[2] = c;
+    record->arg[3] = d;
+    atomic_store_explicit(&record->seq, (uint32_t)seq + 1, memory_order_release);
+    atomic_store_explicit(ring->head, seq + 1, memory_order_release);
+}
+
+#define TRACE(event, a, b, c, d) do {					\
+	if (TRACE_LEVEL_##event <= XHK_TRACE_LEVEL)			\
+		trace_record(TRACE_##event, a, b, c, d);		\
+} while (0)
+
+/*
+ * Trace into rings of the given number of records (a power of two) for
+ * each thread. With mmap, the rings are a shared mapping of path itself,
+ * so are on disk even if xhk dies; otherwise they are written to path by
+ * trace_close(). The calling thread traces as TRACE_THREAD_EVENT.
+ */
+int trace_open(const char * path, uint64_t records, bool mmap);
+void trace_close(void);
+
+/* Start tracing from the calling thread, when a trace is open */
+void trace_thread(enum trace_thread thread);
+
+#endif /* XHK_TRACE_H_ */
@@ -0,0 +1,195 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Trace decoder: prints an xhk binary trace as text, with key names and
+    times in microseconds.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xhk-trace.h"
+#include "xhk-keynames.h"
+
+#define TRACE_NAME(name, level, format) #name,
+static const char * EventNames[TRACE_EVENTS] = {
+    XHK_TRACE_EVENTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+#define TRACE_FORMAT(name, level, format) format,
+static const char * EventFormats[TRACE_EVENTS] = {
+    XHK_TRACE_EVENTS(TRACE_FORMAT)
+};
+#undef TRACE_FORMAT
+
+static void print_key(uint32_t keycode)
+{
+    for (size_t i = 0; i < sizeof(KeyNames) / sizeof(KeyNames[0]); i++)
+        if ((uint32_t)KeyNames[i].keycode == keycode) {
+            printf("%s", KeyNames[i].name);
+            return;
+        }
+
+    printf("%u", keycode);
+}
+
+static void print_record(const TraceRecord_t * record)
+{
+    const char * format = EventFormats[record->event];
+    int arg = 0;
+
+    printf("%-10s ", EventNames[record->event]);
+
+    for (const char * p = format; *p; p++) {
+        if (*p != '%' || arg == 4) {
+            putchar(*p);
+            continue;
+        }
+
+        switch (*++p) {
+        case 'k':
+            print_key(record->arg[arg++]);
+            break;
+        case 'd':
+            printf("%s", record->arg[arg++] ? "down" : "up");
+            break;
+        case 'x':
+            printf("%x", record->arg[arg++]);
+            break;
+        case 'u':
+            printf("%u", record->arg[arg++]);
+            break;
+        default:
+            putchar(*p);
+            break;
+        }
+    }
+
+    putchar('\n');
+}
+
+static const char * ThreadNames[TRACE_THREADS] = {
+    [TRACE_THREAD_EVENT] = "event",
+    [TRACE_THREAD_INJECTOR] = "injector",
+    [TRACE_THREAD_CONFIG] = "config",
+};
+
+/* A record, and the thread it came from */
+typedef struct Entry_s {
+    const TraceRecord_t * record;
+    int thread;
+} Entry_t;
+
+static int by_time(const void * a, const void * b)
+{
+    uint64_t ta = ((const Entry_t *)a)->record->time;
+    uint64_t tb = ((const Entry_t *)b)->record->time;
+
+    return (ta > tb) - (ta < tb);
+}
+
+int main(int argc, char ** argv)
+{
+    TraceHeader_t header;
+    TraceRecord_t * records;
+    Entry_t * entries;
+    size_t nentries = 0;
+    uint64_t start, last;
+    double ns_per_tick;
+    unsigned long torn = 0;
+    FILE * fp;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp || fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+            || header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord_t)
+            || header.threads != TRACE_THREADS
+            || header.records == 0 || (header.records & (header.records - 1))) {
+        fprintf(stderr, "%s is not an xhk trace\n", argv[1]);
+        return 1;
+    }
+
+    records = malloc(TRACE_THREADS * header.records * sizeof(*records));
+    entries = malloc(TRACE_THREADS * header.records * sizeof(*entries));
+    if (!records || !entries
+            || fread(records, sizeof(*records), TRACE_THREADS * header.records, fp)
+            != TRACE_THREADS * header.records) {
+        fprintf(stderr, "%s is truncated\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    ns_per_tick = header.ticks[1] > header.ticks[0]
+                  ? (double)(header.ns[1] - header.ns[0]) / (header.ticks[1] - header.ticks[0])
+                  : 1.0;
+
+    /* Gather every thread's complete records, then merge them by time */
+    for (int thread = 0; thread < TRACE_THREADS; thread++) {
+        TraceRecord_t * ring = records + thread * header.records;
+        uint64_t head = atomic_load(&header.head[thread]);
+        uint64_t first = head > header.records ? head - header.records : 0;
+
+        if (first)
+            printf("# %llu %s records were overwritten\n", (unsigned long long)first,
+                   ThreadNames[thread]);
+
+        for (uint64_t seq = first; seq < head; seq++) {
+            const TraceRecord_t * record = &ring[seq & (header.records - 1)];
+
+            /* Still being written when the trace was taken */
+            if (atomic_load(&record->seq) != (uint32_t)(seq + 1) || record->event >= TRACE_EVENTS) {
+                torn++;
+                continue;
+            }
+
+            entries[nentries++] = (Entry_t) { record, thread };
+        }
+    }
+
+    qsort(entries, nentries, sizeof(*entries), by_time);
+
+    printf("# %12s %10s %-8s\n", "time/us", "delta/us", "thread");
+
+    start = last = nentries ? entries[0].record->time : 0;
+
+    for (size_t i = 0; i < nentries; i++) {
+        const TraceRecord_t * record = entries[i].record;
+
+        printf("%14.3f %10.3f %-8s ", (record->time - start) * ns_per_tick / 1e3,
+               (record->time - last) * ns_per_tick / 1e3, ThreadNames[entries[i].thread]);
+        print_record(record);
+
+        last = record->time;
+    }
+
+    if (torn)
+        printf("# %lu incomplete records skipped\n", torn);
+
+    free(entries);
+    free(records);
+
+    return 0;
+}
@@ -0,0 +1,606 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    End to end benchmark: xhk is run against an Xvfb of its own and typed
+    at through XTEST, and each key it injects is timed as it reaches a
+    client. Results are printed as one JSON object per phase.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/XTest.h>
+
+#include "xhk-layout.h"
+#include "xhk-mirror.h"
+
+/*
+ * The keys are typed from a master device of our own, so that they come
+ * from its XTEST keyboard while xhk injects through the core one. XTEST
+ * devices can't be floated, so that one keeps its master, which nobody
+ * listens to.
+ */
+#define MASTER_NAME "xhk-bench"
+#define DEVICE_NAME MASTER_NAME " XTEST keyboard"
+
+#define DEFAULT_KEYS 2000
+#define KEY_TIMEOUT_MS 1000
+#define SETTLE_MS 100
+#define XHK_START_MS 5000
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const uint8_t LeftKeys[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B,
+};
+
+/* Key presses as the listening client received them */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+    Display * display;
+    int device;
+    bool stop;
+
+    uint64_t * times;
+    uint8_t * keycodes;
+    size_t count;
+    size_t size;
+} Received = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .arrived = PTHREAD_COND_INITIALIZER,
+};
+
+/* The counters xhk serves on its metrics socket which we report on */
+typedef struct Metrics_s {
+    double events;
+    double injected;
+    double flushes;
+    double requests;
+} Metrics_t;
+
+static bool Verbose = false;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    nanosleep(&ts, NULL);
+}
+
+static void quiet(void)
+{
+    int null = open("/dev/null", O_WRONLY);
+
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+}
+
+/* Start an Xvfb on the first free display, and point DISPLAY at it */
+static pid_t start_xvfb(void)
+{
+    char fd[16], display[32] = ":";
+    size_t length = 1;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds))
+        return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (!Verbose)
+            quiet();
+        snprintf(fd, sizeof(fd), "%d", fds[1]);
+        execlp("Xvfb", "Xvfb", "-displayfd", fd, "-nolisten", "tcp", "-noreset",
+               "-screen", "0", "640x480x24", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    /* The display number, then a newline, once the server is ready */
+    while (pid > 0 && length < sizeof(display) - 1) {
+        ssize_t n = read(fds[0], &display[length], 1);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || display[length] == '\n')
+            break;
+        length++;
+    }
+    display[length] = '\0';
+    close(fds[0]);
+
+    if (pid < 0 || length == 1) {
+        fprintf(stderr, "Couldn't start Xvfb\n");
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    setenv("DISPLAY", display, 1);
+
+    return pid;
+}
+
+static int find_device(Display * display, int which, int use, const char * name)
+{
+    XIDeviceInfo * devices;
+    int ndevices, id = -1;
+
+    devices = XIQueryDevice(display, which, &ndevices);
+    for (int i = 0; i < ndevices; i++)
+        if (devices[i].use == use && (!name || strcmp(devices[i].name, name) == 0)) {
+            id = devices[i].deviceid;
+            break;
+        }
+    XIFreeDeviceInfo(devices);
+
+    return id;
+}
+
+/* Add our own master, and make its XTEST devices the ones we type through */
+static int add_master(Display * display)
+{
+    XIAddMasterInfo add = {
+        .type = XIAddMaster,
+        .name = MASTER_NAME,
+        .send_core = True,
+        .enable = True,
+    };
+    int pointer;
+
+    XIChangeHierarchy(display, (XIAnyHierarchyChangeInfo *)&add, 1);
+    XSync(display, False);
+
+    pointer = find_device(display, XIAllMasterDevices, XIMasterPointer, MASTER_NAME " pointer");
+    if (pointer < 0 || find_device(display, XIAllDevices, XISlaveKeyboard, DEVICE_NAME) < 0) {
+        fprintf(stderr, "Couldn't add a master device to type from\n");
+        return -1;
+    }
+
+    XISetClientPointer(display, None, pointer);
+    XSync(display, False);
+
+    return 0;
+}
+
+/* Record every key press the core keyboard delivers, as it arrives */
+static void * listen_keys(void * data)
+{
+    Display * display = Received.display;
+    struct pollfd pfd = { .fd = ConnectionNumber(display), .events = POLLIN };
+    XEvent ev;
+
+    for (;;) {
+        pthread_mutex_lock(&Received.lock);
+        if (Received.stop) {
+            pthread_mutex_unlock(&Received.lock);
+            break;
+        }
+        pthread_mutex_unlock(&Received.lock);
+
+        if (!XPending(display)) {
+            poll(&pfd, 1, 50);
+            continue;
+        }
+
+        XNextEvent(display, &ev);
+        if (ev.xcookie.type != GenericEvent || !XGetEventData(display, &ev.xcookie))
+            continue;
+
+        XIDeviceEvent * event = ev.xcookie.data;
+        if (event->evtype == XI_KeyPress && event->deviceid == Received.device) {
+            uint64_t time = now();
+
+            pthread_mutex_lock(&Received.lock);
+            if (Received.count < Received.size) {
+                Received.times[Received.count] = time;
+                Received.keycodes[Received.count] = event->detail;
+            }
+            Received.count++;
+            pthread_cond_signal(&Received.arrived);
+            pthread_mutex_unlock(&Received.lock);
+        }
+        XFreeEventData(display, &ev.xcookie);
+    }
+
+    return NULL;
+}
+
+static int start_listener(pthread_t * thread, size_t size)
+{
+    unsigned char mask[1] = { 0 };
+    XIEventMask eventmask = { .mask_len = sizeof(mask), .mask = mask };
+    Display * display = XOpenDisplay(NULL);
+
+    if (!display)
+        return -1;
+
+    Received.device = find_device(display, XIAllMasterDevices, XIMasterKeyboard, "Virtual core keyboard");
+    Received.times = calloc(size, sizeof(*Received.times));
+    Received.keycodes = calloc(size, sizeof(*Received.keycodes));
+    Received.size = size;
+    Received.display = display;
+    if (Received.device < 0 || !Received.times || !Received.keycodes)
+        return -1;
+
+    eventmask.deviceid = Received.device;
+    XISetMask(mask, XI_KeyPress);
+    XISelectEvents(display, DefaultRootWindow(display), &eventmask, 1);
+    XSync(display, False);
+
+    return pthread_create(thread, NULL, listen_keys, NULL) ? -1 : 0;
+}
+
+static void stop_listener(pthread_t thread)
+{
+    pthread_mutex_lock(&Received.lock);
+    Received.stop = true;
+    pthread_mutex_unlock(&Received.lock);
+
+    pthread_join(thread, NULL);
+    XCloseDisplay(Received.display);
+    free(Received.times);
+    free(Received.keycodes);
+}
+
+/* Wait until count presses have arrived, returning how many have */
+static size_t wait_received(size_t count, unsigned int timeout_ms)
+{
+    struct timespec deadline;
+    size_t received;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&Received.lock);
+    while (Received.count < count)
+        if (pthread_cond_timedwait(&Received.arrived, &Received.lock, &deadline) == ETIMEDOUT)
+            break;
+    received = Received.count;
+    pthread_mutex_unlock(&Received.lock);
+
+    return received;
+}
+
+static void reset_received(void)
+{
+    pthread_mutex_lock(&Received.lock);
+    Received.count = 0;
+    pthread_mutex_unlock(&Received.lock);
+}
+
+static int connect_metrics(const char * path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        return fd;
+
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static int read_metrics(const char * path, Metrics_t * metrics)
+{
+    int fd = connect_metrics(path);
+    char line[256];
+    FILE * in;
+
+    if (fd < 0 || !(in = fdopen(fd, "r"))) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        sscanf(line, "xhk_key_events_total %lf", &metrics->events);
+        sscanf(line, "xhk_keys_injected_total %lf", &metrics->injected);
+        sscanf(line, "xhk_flushes_total %lf", &metrics->flushes);
+        sscanf(line, "xhk_x_requests_total %lf", &metrics->requests);
+    }
+    fclose(in);
+
+    return 0;
+}
+
+static pid_t start_xhk(const char * xhk, const char * metrics, char ** args, int nargs)
+{
+    char ** argv = calloc(nargs + 5, sizeof(*argv));
+    char option[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];
+    uint64_t deadline = now() + XHK_START_MS * 1000000ULL;
+    pid_t pid;
+    int fd;
+
+    if (!argv)
+        return -1;
+
+    snprintf(option, sizeof(option), "--metrics=%s", metrics);
+    argv[0] = (char *)xhk;
+    argv[1] = "-i";
+    argv[2] = DEVICE_NAME;
+    argv[3] = option;
+    for (int i = 0; i < nargs; i++)
+        argv[4 + i] = args[i];
+
+    pid = fork();
+    if (pid == 0) {
+        if (!Verbose)
+            quiet();
+        execv(xhk, argv);
+        _exit(127);
+    }
+    free(argv);
+
+    /* xhk serves its metrics once it has taken the keyboard */
+    while (pid > 0 && now() < deadline) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+
+        fd = connect_metrics(metrics);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        sleep_ms(10);
+    }
+
+    fprintf(stderr, "xhk didn't start\n");
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    return -1;
+}
+
+static void stop_child(pid_t pid)
+{
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static int compare(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The phases. Each types keys and expects a press of each back from xhk:
+ * one at a time to measure latency, or all at once for throughput.
+ */
+enum { PASSTHROUGH, MIRRORED, THROUGHPUT };
+
+static const char * const Phases[] = { "passthrough", "mirrored", "throughput" };
+
+static void run_phase(Display * display, int phase, size_t keys, const char * metrics,
+                      const char * xhk, const char * args, FILE * out)
+{
+    uint64_t * sent = calloc(keys, sizeof(*sent));
+    uint64_t * latency = calloc(keys, sizeof(*latency));
+    uint8_t * expected = calloc(keys, sizeof(*expected));
+    Metrics_t before = { 0 }, after = { 0 };
+    size_t received, wrong = 0, timed = 0;
+    uint64_t elapsed;
+
+    if (!sent || !latency || !expected)
+        goto out;
+
+    sleep_ms(SETTLE_MS);
+    reset_received();
+    read_metrics(metrics, &before);
+
+    if (phase == MIRRORED) {
+        XTestFakeKeyEvent(display, KEY_SPACE, True, CurrentTime);
+        XFlush(display);
+        sleep_ms(SETTLE_MS);
+    }
+
+    for (size_t i = 0; i < keys; i++) {
+        uint8_t keycode = LeftKeys[i % ARRAY_SIZE(LeftKeys)];
+
+        expected[i] = phase == MIRRORED ? xhk_layouts[0].mirror[keycode] : keycode;
+
+        sent[i] = now();
+        XTestFakeKeyEvent(display, keycode, True, CurrentTime);
+        XTestFakeKeyEvent(display, keycode, False, CurrentTime);
+
+        if (phase == THROUGHPUT) {
+            /* Keep the server busy without a round trip per key */
+            if (i % 32 == 31)
+                XFlush(display);
+        } else {
+            XFlush(display);
+            wait_received(i + 1, KEY_TIMEOUT_MS);
+        }
+    }
+    XFlush(display);
+
+    received = wait_received(keys, phase == THROUGHPUT ? 10 * KEY_TIMEOUT_MS : KEY_TIMEOUT_MS);
+    elapsed = received ? Received.times[(received < keys ? received : keys) - 1] - sent[0] : 0;
+
+    if (phase == MIRRORED) {
+        XTestFakeKeyEvent(display, KEY_SPACE, False, CurrentTime);
+        XFlush(display);
+    }
+
+    sleep_ms(SETTLE_MS);
+    read_metrics(metrics, &after);
+
+    for (size_t i = 0; i < received && i < keys; i++) {
+        if (Received.keycodes[i] != expected[i])
+            wrong++;
+        latency[timed++] = Received.times[i] - sent[i];
+    }
+    qsort(latency, timed, sizeof(*latency), compare);
+
+#define PER_KEY(counter) ((after.counter - before.counter) / keys)
+#define PERCENTILE_US(p) (timed ? latency[(size_t)((timed - 1) * (p))] / 1e3 : 0.0)
+
+    fprintf(out, "{\"phase\":\"%s\",\"xhk\":\"%s\",\"xhk_args\":\"%s\",\"keys\":%zu,\"received\":%zu,\"wrong\":%zu,"
+            "\"keys_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+            "\"events_per_key\":%.2f,\"injected_per_key\":%.2f,\"flushes_per_key\":%.3f,"
+            "\"requests_per_key\":%.3f}\n",
+            Phases[phase], xhk, args, keys, received, wrong,
+            elapsed ? received * 1e9 / elapsed : 0.0,
+            PERCENTILE_US(0.5), PERCENTILE_US(0.99), PERCENTILE_US(1.0),
+            PER_KEY(events), PER_KEY(injected), PER_KEY(flushes), PER_KEY(requests));
+    fflush(out);
+
+out:
+    free(sent);
+    free(latency);
+    free(expected);
+}
+
+static void usage(void)
+{
+    printf("Usage: xhk-xbench [-n KEYS] [-x XHK] [-o FILE] [-v] [-- XHK_OPTIONS...]\n");
+    printf("\t-n KEYS type KEYS keys in each phase (default %d)\n", DEFAULT_KEYS);
+    printf("\t-x XHK the xhk to run (default ./xhk)\n");
+    printf("\t-o FILE append the results to FILE rather than print them\n");
+    printf("\t-v show the output of Xvfb and xhk\n");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * xhk = "./xhk";
+    const char * output = NULL;
+    char metrics[64], args[256] = "";
+    size_t keys = DEFAULT_KEYS;
+    pid_t xvfb, child;
+    pthread_t listener;
+    Display * display;
+    FILE * out = stdout;
+    int opt, ret = 1;
+
+    while ((opt = getopt(argc, argv, "n:x:o:vh")) != -1) {
+        switch (opt) {
+        case 'n':
+            keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            xhk = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'v':
+            Verbose = true;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++)
+        snprintf(args + strlen(args), sizeof(args) - strlen(args), "%s%s", i > optind ? " " : "", argv[i]);
+
+    if (keys == 0 || (output && !(out = fopen(output, "a")))) {
+        usage();
+        return 1;
+    }
+
+    xvfb = start_xvfb();
+    if (xvfb < 0)
+        return 1;
+
+    display = XOpenDisplay(NULL);
+    if (!display) {
+        fprintf(stderr, "Couldn't connect to Xvfb\n");
+        goto out_xvfb;
+    }
+
+    {
+        int event, error, major = 2, minor = 0;
+
+        if (XIQueryVersion(display, &major, &minor) != Success
+                || !XTestQueryExtension(display, &event, &error, &major, &minor)) {
+            fprintf(stderr, "Xvfb has no XI2 or XTEST\n");
+            goto out_display;
+        }
+    }
+
+    if (add_master(display) || start_listener(&listener, keys))
+        goto out_display;
+
+    snprintf(metrics, sizeof(metrics), "/tmp/xhk-xbench-%d.sock", (int)getpid());
+    child = start_xhk(xhk, metrics, &argv[optind], argc - optind);
+    if (child > 0) {
+        for (int phase = PASSTHROUGH; phase <= THROUGHPUT; phase++)
+            run_phase(display, phase, keys, metrics, xhk, args, out);
+        stop_child(child);
+        ret = 0;
+    }
+
+    stop_listener(listener);
+out_display:
+    XCloseDisplay(display);
+out_xvfb:
+    stop_child(xvfb);
+    if (out != stdout)
+        fclose(out);
+
+    return ret;
+}
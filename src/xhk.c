@@ -26,12 +26,16 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 
 /* Go Real Time */
 #include <sys/resource.h>
 
 #include <X11/X.h>
+#include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/XInput2.h>
@@ -42,29 +46,31 @@
 
 #include <X11/XKBlib.h>
 
+#include "xhk.h"
+#include "xhk-config.h"
+#include "xhk-control.h"
+#include "xhk-engine.h"
+#include "xhk-keymap.h"
+#include "xhk-latency.h"
+#include "xhk-loop.h"
+#include "xhk-metrics.h"
+#include "xhk-predict.h"
+#include "xhk-realtime.h"
+#include "xhk-trace.h"
+
 // KeyCode mappings to Layout nomenclatures
 #include "xhk-layout.h"
+#include "xhk-mirror.h"
 
 #ifndef VERSION
 #define VERSION "1.2"
 #endif
 
-static int verbose = 1;
-
-#define PRINT(level, x ...) 	if (verbose >= level) printf(x)
-#define ERROR(...) 		PRINT(0, 	 ##__VA_ARGS__)
-#define REPORT(...) 		PRINT(1, 	 ##__VA_ARGS__)
-#define INFO(...) 		PRINT(2, 	 ##__VA_ARGS__)
-#define DEBUG(...) 		PRINT(3, 	 ##__VA_ARGS__)
-#define VERBOSE(level, ...) 	PRINT(level, ##__VA_ARGS__)
+int verbose = 1;
 
-static bool ApplicationRunning = true;
+bool ApplicationRunning = true;
 static bool MirrorMode = false;
-
-/* KeyStates == key_down / is_pressed */
-#define KEYSTATE_DOWN 1
-#define KEYSTATE_UP   0
-static int keystates[255] = { 0 }; /* Initialised up */
+static const struct xhk_layout * Layout = &xhk_layouts[0];
 
 static int ioErrorHandler(Display* d)
 {
@@ -74,19 +80,37 @@ static int ioErrorHandler(Display* d)
     return 0;
 }
 
-typedef struct XWindowsScreen_s {
-    Display* display;
-
-    XIDeviceInfo keyboard;
+/*
+ * A device can vanish between its hierarchy event and our floating it, and
+ * XTEST devices can never be floated: neither is worth exiting for.
+ */
+static int errorHandler(Display * d, XErrorEvent * error)
+{
+    INFO("X Error %d on request %d.%d\n", error->error_code, error->request_code, error->minor_code);
 
-    XKeyboardState   KBState;
-    XKeyboardControl KBControl;
-} XWindowsScreen_t;
+    return 0;
+}
 
 
 static XWindowsScreen_t LocalScreen;
 
-static int XInputDevice = -1;
+/* --pipeline: inject from a thread, and for X, a connection of its own */
+static bool Pipeline = false;
+static XWindowsScreen_t InjectScreen;
+
+static bool ReportLatency = false;
+
+/* --metrics: a Unix socket to serve live counters on */
+static const char * MetricsPath = NULL;
+
+/* --control: a Unix socket to take commands on */
+static const char * ControlPath = NULL;
+
+/* --no-raw: select full device events, even where XI 2.2 has raw ones */
+static bool RawEvents = true;
+
+/* -i: a list of device ids, or a pattern to match device names against */
+static const char * XInputDevices = NULL;
 
 
 Display* OpenDisplay(const char* displayName)
@@ -153,36 +177,219 @@ reattach_device(Display* dpy, int devid, int master)
 }
 
 
-static int ConfigureKeyboard(XWindowsScreen_t * screen)
+/*
+ * The keys we inject are autorepeated by the server already, so repeats
+ * from the floated keyboard are never used. Stop it sending them at all.
+ */
+static void disable_autorepeat(XWindowsScreen_t * screen, Keyboard_t * keyboard)
+{
+    XkbDescPtr xkb = XkbAllocKeyboard();
+
+    if (!xkb)
+        return;
+
+    xkb->device_spec = keyboard->deviceid;
+    if (XkbGetControls(screen->display, XkbAllControlsMask, xkb) == Success)
+        keyboard->autorepeat = (xkb->ctrls->enabled_ctrls & XkbRepeatKeysMask) != 0;
+    XkbFreeKeyboard(xkb, 0, True);
+
+    if (keyboard->autorepeat) {
+        INFO("Disabling autorepeat on device ID %d\n", keyboard->deviceid);
+        XkbChangeEnabledControls(screen->display, keyboard->deviceid, XkbRepeatKeysMask, 0);
+    }
+}
+
+/*
+ * Raw key events carry no window, coordinates or modifier state, none of
+ * which we use, and reach the root window whatever has the focus.
+ */
+static void set_key_mask(XWindowsScreen_t * screen, unsigned char * mask)
+{
+    if (screen->xi_raw) {
+        XISetMask(mask, XI_RawKeyPress);
+        XISetMask(mask, XI_RawKeyRelease);
+    } else {
+        XISetMask(mask, XI_KeyPress);
+        XISetMask(mask, XI_KeyRelease);
+    }
+}
+
+static int ConfigureKeyboards(XWindowsScreen_t * screen)
 {
     int ret;
-    int devid = screen->keyboard.deviceid;
+    XIEventMask eventmasks[MAX_KEYBOARDS + 1];
+    unsigned char mask[XIMaskLen(XI_RawKeyRelease)] = { 0 }; /* the actual mask, shared by every device */
+    unsigned char devices[2] = { 0 };
 
     XGetKeyboardControl(screen->display, &screen->KBState);
 
-    /* Select to receive all events from device N */
+    /* now set the mask */
+    set_key_mask(screen, mask);
 
-    XIEventMask eventmask;
-    unsigned char mask[1] = { 0 }; /* the actual mask */
+    /* Select to receive all events from every device, in a single request */
+    for (int i = 0; i < screen->nkeyboards; i++) {
+        eventmasks[i].deviceid = screen->keyboards[i].deviceid;
+        eventmasks[i].mask_len = sizeof(mask); /* always in bytes */
+        eventmasks[i].mask = mask;
+    }
 
-    eventmask.deviceid = devid;
-    eventmask.mask_len = sizeof(mask); /* always in bytes */
-    eventmask.mask = mask;
-    /* now set the mask */
-    XISetMask(mask, XI_KeyPress);
-    XISetMask(mask, XI_KeyRelease);
+    /* Keyboards coming and going, from any device: see handle_hierarchy() */
+    XISetMask(devices, XI_HierarchyChanged);
+    XISetMask(devices, XI_DeviceChanged);
+    eventmasks[screen->nkeyboards].deviceid = XIAllDevices;
+    eventmasks[screen->nkeyboards].mask_len = sizeof(devices);
+    eventmasks[screen->nkeyboards].mask = devices;
 
     /* select on the window */
-    ret = XISelectEvents(screen->display, DefaultRootWindow(screen->display), &eventmask, 1);
+    ret = XISelectEvents(screen->display, DefaultRootWindow(screen->display), eventmasks, screen->nkeyboards + 1);
 
     DEBUG("XISelectEvents returned %d which could be %s\n", ret, (ret == 0 ? "Ok" : ret == BadValue ? "BadValue" : ret == BadWindow ? "BadWindow" : "Unknown"));
 
-    /* Detach the keyboard so that no one else receives input from this Keyboard */
-    float_device(screen->display, devid);
+    /* Detach the keyboards so that no one else receives input from them */
+    for (int i = 0; i < screen->nkeyboards; i++) {
+        disable_autorepeat(screen, &screen->keyboards[i]);
+        float_device(screen->display, screen->keyboards[i].deviceid);
+    }
 
     return 0;
 }
 
+/* Take over a keyboard which has arrived since ConfigureKeyboards() */
+static void configure_keyboard(XWindowsScreen_t * screen, Keyboard_t * keyboard)
+{
+    unsigned char mask[XIMaskLen(XI_RawKeyRelease)] = { 0 };
+    XIEventMask eventmask = {
+        .deviceid = keyboard->deviceid,
+        .mask_len = sizeof(mask),
+        .mask = mask,
+    };
+    bool autorepeat = keyboard->autorepeat;
+
+    set_key_mask(screen, mask);
+    XISelectEvents(screen->display, DefaultRootWindow(screen->display), &eventmask, 1);
+
+    /* Back from a suspend, it may still have the autorepeat we turned off */
+    disable_autorepeat(screen, keyboard);
+    keyboard->autorepeat |= autorepeat;
+    float_device(screen->display, keyboard->deviceid);
+}
+
+/* Put every keyboard back where we found it */
+static void reattach_keyboards(XWindowsScreen_t * screen)
+{
+    for (int i = 0; i < screen->nkeyboards; i++) {
+        Keyboard_t * keyboard = &screen->keyboards[i];
+
+        if (keyboard->deviceid == KEYBOARD_UNPLUGGED)
+            continue;
+
+        reattach_device(screen->display, keyboard->deviceid, keyboard->attachment);
+
+        if (keyboard->autorepeat)
+            XkbChangeEnabledControls(screen->display, keyboard->deviceid,
+                                     XkbRepeatKeysMask, XkbRepeatKeysMask);
+    }
+}
+
+Keyboard_t * add_keyboard(XWindowsScreen_t * screen, int deviceid, int attachment, const char * name)
+{
+    Keyboard_t * keyboard;
+
+    if (screen->nkeyboards == MAX_KEYBOARDS) {
+        ERROR("Too many keyboards, ignoring %s (id: %d)\n", name, deviceid);
+        return NULL;
+    }
+
+    keyboard = &screen->keyboards[screen->nkeyboards++];
+    keyboard->deviceid = deviceid;
+    keyboard->attachment = attachment;
+    keyboard->autorepeat = false;
+    keyboard->name = strdup(name);
+    keyboard->word = (PredictWord_t) { .length = 0 };
+
+    engine_init(&keyboard->engine, config_current());
+
+    return keyboard;
+}
+
+void free_keyboards(XWindowsScreen_t * screen)
+{
+    for (int i = 0; i < screen->nkeyboards; i++)
+        free(screen->keyboards[i].name);
+
+    screen->nkeyboards = 0;
+}
+
+static inline Keyboard_t * find_keyboard(XWindowsScreen_t * screen, int deviceid)
+{
+    for (int i = 0; i < screen->nkeyboards; i++)
+        if (screen->keyboards[i].deviceid == deviceid)
+            return &screen->keyboards[i];
+
+    return NULL;
+}
+
+static void update_focus(XWindowsScreen_t * screen)
+{
+    Window focus = None;
+    int revert;
+
+    if (screen->ewmh_focus) {
+        Atom type;
+        int format;
+        unsigned long nitems, remaining;
+        unsigned char * data = NULL;
+
+        if (XGetWindowProperty(screen->display, DefaultRootWindow(screen->display),
+                               screen->NetActiveWindow, 0, 1, False, XA_WINDOW,
+                               &type, &format, &nitems, &remaining, &data) == Success
+                && type == XA_WINDOW && format == 32 && nitems == 1)
+            focus = *(Window *)data;
+        else
+            screen->ewmh_focus = false; /* No (longer an) EWMH window manager */
+
+        if (data)
+            XFree(data);
+    }
+
+    if (!screen->ewmh_focus)
+        XGetInputFocus(screen->display, &focus, &revert);
+
+    if (focus != screen->focus) {
+        DEBUG("Focus changed to window 0x%lx\n", focus);
+        TRACE(FOCUS, focus, 0, 0, 0);
+    }
+
+    screen->focus = focus;
+}
+
+/*
+ * Track the focused window from events rather than asking for it.
+ *
+ * With an EWMH window manager we follow _NET_ACTIVE_WINDOW on the root
+ * window. Without one we can only learn of focus moves which involve the
+ * root window itself, through FocusIn on root.
+ */
+static void TrackFocus(XWindowsScreen_t * screen)
+{
+    Window root = DefaultRootWindow(screen->display);
+
+    screen->NetActiveWindow = XInternAtom(screen->display, "_NET_ACTIVE_WINDOW", False);
+    screen->ewmh_focus = true;
+
+    XSelectInput(screen->display, root, PropertyChangeMask | FocusChangeMask);
+
+    update_focus(screen);
+}
+
+/* Show what mirrors to what, by the names the keymap gives the keys */
+static void report_mirror(const EngineTable_t * table)
+{
+    for (int keycode = 0; keycode < 256; keycode++)
+        if (table->layers[0].map[keycode] > keycode)
+            DEBUG("Mirroring %s <-> %s\n", keymap_name(keycode), keymap_name(table->layers[0].map[keycode]));
+}
+
 static XWindowsScreen_t * construct()
 {
     LocalScreen = (XWindowsScreen_t) {
@@ -191,269 +398,261 @@ static XWindowsScreen_t * construct()
 
     // set the X I/O error handler so we catch the display disconnecting
     XSetIOErrorHandler(&ioErrorHandler);
+    XSetErrorHandler(&errorHandler);
 
     LocalScreen.display = OpenDisplay(NULL);
     if (LocalScreen.display == NULL)
         return NULL;
 
+    if (x11_io_open(&LocalScreen)) {
+        XCloseDisplay(LocalScreen.display);
+        LocalScreen.display = NULL;
+        return NULL;
+    }
+
     return &LocalScreen;
 }
 
-int destruct(XWindowsScreen_t * screen)
+static int start_pipeline(XWindowsScreen_t * screen)
 {
+    InjectScreen = (XWindowsScreen_t) {
+        0
+    };
+
     if (screen->display) {
-        // Please Sir, can I have my Keyboard back?
-        /* Attachment describes what the device was attached to before we caused it to float */
-        reattach_device(screen->display, screen->keyboard.deviceid, screen->keyboard.attachment);
+        InjectScreen.display = OpenDisplay(NULL);
+        if (InjectScreen.display == NULL || x11_io_open(&InjectScreen)) {
+            ERROR("Couldn't open a second connection for injection\n");
+            if (InjectScreen.display)
+                XCloseDisplay(InjectScreen.display);
+            InjectScreen.display = NULL;
+            return -1;
+        }
+    } else {
+        /* evdev and replay inject to a device only the injector writes to */
+        InjectScreen.io = screen->io;
+    }
 
-        XCloseDisplay(screen->display);
+    if (pipeline_start(screen, &InjectScreen)) {
+        if (InjectScreen.display) {
+            InjectScreen.io->close(&InjectScreen);
+            XCloseDisplay(InjectScreen.display);
+            InjectScreen.display = NULL;
+        }
+        return -1;
     }
 
     return 0;
 }
 
-char * keycode_to_char(XWindowsScreen_t * screen, int keycode)
+static void stop_pipeline(XWindowsScreen_t * screen)
 {
-    KeySym ks = XkbKeycodeToKeysym(screen->display, keycode, 0, 0);
-    return XKeysymToString(ks);
+    if (!screen->pipelined)
+        return;
+
+    pipeline_stop(screen);
+
+    if (InjectScreen.display) {
+        InjectScreen.io->close(&InjectScreen);
+        XCloseDisplay(InjectScreen.display);
+        InjectScreen.display = NULL;
+    }
 }
 
-static int SendKey(XWindowsScreen_t * screen, int keycode, int key_down, unsigned long time)
+int destruct(XWindowsScreen_t * screen)
 {
-    DEBUG("Sending keycode %s %d, (%s) to XTest at %lu\n", key_down ? "Down" : "Up", keycode, keycode_to_char(screen, keycode), time);
+    if (screen->display) {
+        // Please Sir, can I have my Keyboards back?
+        /* Attachment describes what each device was attached to before we caused it to float */
+        reattach_keyboards(screen);
 
-    int ret = XTestFakeKeyEvent(screen->display, keycode, key_down ? true : false, CurrentTime);
+        keymap_close();
+        screen->io->close(screen);
+        XCloseDisplay(screen->display);
+    }
 
-    if (ret == 0)
-        ERROR("XTestFakeKeyEvent failed to submit keycode %s %d at %lu\n", key_down ? "Down" : "Up", keycode, time);
+    free_keyboards(screen);
 
-    XFlush(screen->display);
+    return 0;
+}
 
-    /* Record this action in our state table */
-    keystates[keycode] = key_down;
+int FlushKeys(XWindowsScreen_t * screen)
+{
+    int ret = 1;
 
-    return ret;
-}
+    if (screen->inject_count == 0)
+        return ret;
 
-int mirror_key(int keycode)
-{
-    /************************
-    * Half-Key heavily based on code by John Meacham
-    * john@foo.net
-    * Adapted for X Keycodes, special cases and extra rows.
-    ***********************/
-    int t=0;
-
-    if(keycode >= KEY_1 && keycode <= KEY_0) t = KEY_1; // numbers
-    if(keycode >= KEY_Q && keycode <= KEY_P) t = KEY_Q; // top row
-    if(keycode >= KEY_A && keycode <= KEY_SEMICOLON) t = KEY_A; // middle row
-    if(keycode >= KEY_Z && keycode <= KEY_FSLASH) t = KEY_Z; // bottom row
-    if(t) {
-        int temp = keycode;
-        temp -=t+4;
-        if(temp < 1) temp--;
-        temp = -temp;
-        if(temp < 1) temp++;
-        temp +=t+4;
-        keycode = temp;
-    }
-
-    /* Swap special cases */
-    switch(keycode) {
-    case KEY_BACKSPACE:
-        keycode = KEY_TAB;
-        break;
-    case KEY_TAB:
-        keycode = KEY_BACKSPACE;
-        break;
-
-    case KEY_ENTER:
-        keycode = KEY_CAPS;
-        break;
-    case KEY_CAPS:
-        keycode = KEY_ENTER;
-        break;
-
-    case KEY_MINUS:
-        keycode = KEY_GRAVE;
-        break;
-    case KEY_GRAVE:
-        keycode = KEY_MINUS;
-        break;
-    }
-
-    return keycode;
-}
-
-#define SPACE_STATE_START    0
-#define SPACE_STATE_PRESSED  1
-#define SPACE_STATE_MODIFIED 2
-
-char * SpaceStateNames[] = {
-    "Start",
-    "Pressed",
-    "Modified",
-};
+    if (screen->pipelined) {
+        pipeline_push(screen);
+        return ret;
+    }
 
-static int space = SPACE_STATE_START;
-
-int ProcessKeycode(XWindowsScreen_t * screen, int keycode, int up_flag)
-{
-    int mirrored_key;
-    bool mirrored;
-
-    DEBUG("Entering ProcessKeycode in state %s\n", SpaceStateNames[space]);
-
-    /* MirrorMode mirrors all keys before the state machine operates */
-    if (MirrorMode)
-        keycode = mirror_key(keycode);
-
-    /*
-     * SPACE State Table
-     *
-     * 			START		PRESSED		MODIFIED
-     *
-     * SpaceDown	Discarded	Discarded	Discarded
-     * 			-> Pressed	-> Pressed	-> Modified
-     *
-     * SpaceUp		Invalid?	InjectSpace	UpAllModifiedDowns?
-     * 			-> Start	-> Start	-> Start
-     *
-     * MirroredKey	InjectKey	MirrorKey	MirrorKey
-     * 			-> Start	-> Modified	-> Modified
-     *
-     * OtherKey		InjectKey	InjectKey	InjectKey
-     * 			-> Start	-> Pressed	-> Modified
-     */
-
-    if(keycode == KEY_SPACE) {
-        switch(space) {
-        case SPACE_STATE_START:
-            space = SPACE_STATE_PRESSED;
-            return -1; /* Change state but swallow the Space Input Event */
-        case SPACE_STATE_PRESSED:
-            if(up_flag) {
-                /* Space released before any other key */
-                /* We discarded the original Space Down event, so provide one now */
-                SendKey(screen, keycode, true, CurrentTime);
-                space = SPACE_STATE_START;
-                return keycode; /* Space bar released, allow it to be pressed */
-            } else
-                return -1; /* Ignore and swallow repeated space down events */
-            break;
-        case SPACE_STATE_MODIFIED:
-            if(up_flag)
-                space = SPACE_STATE_START;
-            return -1;
+    for (int i = 0; i < screen->inject_count; i++) {
+        int keycode = screen->inject[i].keycode;
+        bool key_down = screen->inject[i].key_down;
+
+        if (screen->io->fake_key(screen, keycode, key_down) == 0) {
+            ERROR("Failed to submit keycode %s %d\n", key_down ? "Down" : "Up", keycode);
+            ret = 0;
         }
     }
 
-    /* Mirror the key once to prevent excess checking */
-    mirrored_key = mirror_key(keycode);
-    /* Determine if the key was modified by our mirror - Not all keys flip */
-    mirrored = (mirrored_key != keycode);
+    screen->io->flush(screen);
+    statistic_add(&screen->flushes, 1);
 
-    /* Only change state if this action would mirror a key */
-    if( mirrored && (space != SPACE_STATE_START) ) {
-        space = SPACE_STATE_MODIFIED; /* Space bar can no longer insert a space char */
-        keycode = mirrored_key;
-    }
+    TRACE(FLUSH, screen->inject_count, 0, 0, 0);
 
-    /* Allow the user to 'cancel' a modifier without performing any further action */
-    if(keycode == KEY_ESC && space != SPACE_STATE_START) {
-        space = SPACE_STATE_MODIFIED;
-        return -1;
+    uint64_t flushed = latency_now();
+    for (int i = 0; i < screen->inject_count; i++) {
+        latency_record(LATENCY_INJECT, flushed - screen->inject[i].queued);
+        latency_record(LATENCY_TOTAL, flushed - screen->inject[i].received);
     }
 
-    /* Verify that we are only releasing keys that we pressed */
-    if (up_flag && keystates[keycode] == KEYSTATE_UP) { /* Perhaps this was the wrong key */
-        int mirror = mirror_key(keycode);
-        if (keystates[mirror] == KEYSTATE_DOWN) {
-            DEBUG("StateInversion: Releasing key %s instead of %s\n", keycode_to_char(screen, mirror), keycode_to_char(screen, keycode));
-            keycode = mirror; /* We will 'up' this key instead */
+    statistic_add(&screen->injected, screen->inject_count);
+    screen->inject_count = 0;
 
-            /* because of the inversion, we take the SPACE state back a level */
-            if (space == SPACE_STATE_MODIFIED)
-                space = SPACE_STATE_PRESSED;
-        }
-    }
+    return ret;
+}
+
+static int SendKey(XWindowsScreen_t * screen, int keycode, int key_down)
+{
+    TRACE(KEY_OUT, keycode, key_down, 0, 0);
 
-    return keycode;
+    if (screen->inject_count == INJECT_QUEUE_SIZE)
+        FlushKeys(screen);
+
+    screen->inject[screen->inject_count].keycode = keycode;
+    screen->inject[screen->inject_count].key_down = key_down;
+    screen->inject[screen->inject_count].received = screen->received;
+    screen->inject[screen->inject_count].queued = latency_now();
+    screen->inject_count++;
+
+    return 1;
 }
 
-static int handle_key_release(XWindowsScreen_t * screen, XIDeviceEvent *event)
+int unlink_socket(const char * path)
 {
-    int keycode = event->detail;
-    keycode = ProcessKeycode(screen, keycode, 1);
+    struct stat st;
 
-    INFO("Keyrelease %d (%s), keycode = %d (%s) time=%ld\n", event->detail, keycode_to_char(screen, event->detail),
-         keycode, keycode_to_char(screen, keycode),
-         event->time);
+    if (lstat(path, &st))
+        return errno == ENOENT ? 0 : -1;
 
-    if (keycode < 0)
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
         return -1;
+    }
 
-    SendKey(screen, keycode, false, event->time);
+    return unlink(path);
+}
 
-    INFO("\n");
+const struct xhk_layout * find_layout(const char * name)
+{
+    for (const struct xhk_layout * layout = xhk_layouts; layout->name; layout++)
+        if (strcasecmp(layout->name, name) == 0)
+            return layout;
 
-    return 1;
+    return NULL;
 }
 
-static int handle_key_press(XWindowsScreen_t * screen, XIDeviceEvent *event)
+/* Note when the event arrived, and how long the device took to deliver it */
+static void trace_event(XWindowsScreen_t * screen, KeyEvent_t * event)
 {
-    int keycode = event->detail;
+    uint32_t delivery = latency_now_ms(event->received) - (uint32_t)event->time;
 
-    if ( (event->flags & XIKeyRepeat) && (keycode == KEY_SPACE) ) // Ignore SPACE key repeats
-        return -1;
+    screen->received = event->received;
 
-    keycode = ProcessKeycode(screen, keycode, 0);
+    /* Only meaningful when the device timestamps on our clock */
+    if (screen->io->monotonic_time && delivery < 10000)
+        latency_record(LATENCY_DELIVERY, delivery * 1000000ULL);
+}
 
-    INFO("Keypress %d (%s), keycode = %d (%s) time=%ld\n",  event->detail, keycode_to_char(screen, event->detail),
-         keycode, keycode_to_char(screen, keycode),
-         event->time);
+static int handle_key(XWindowsScreen_t * screen, KeyEvent_t * event, bool key_down)
+{
+    Keyboard_t * keyboard = find_keyboard(screen, event->deviceid);
+    Action_t actions[PREDICT_MAX_ACTIONS];
+    int count;
 
-    if (keycode < 0)
-        return -1;
+    if (!keyboard)
+        return -1; /* Not one of ours */
 
-    SendKey(screen, keycode, true, event->time);
+    screen->events++;
+    trace_event(screen, event);
+    record_event(event, key_down);
 
-    INFO("\n");
+    TRACE(KEY_IN, event->keycode, key_down, event->deviceid, event->repeat);
 
-    return 1;
+    /* Pick up any reloaded configuration */
+    keyboard->engine.table = config_current();
+
+    count = engine_process(&keyboard->engine, event->keycode, key_down, event->repeat,
+                           event->time, actions);
+    count = predict_keys(&keyboard->word, keyboard->engine.table, actions, count);
+
+    latency_record(LATENCY_PROCESS, latency_now() - event->received);
+
+    TRACE(ENGINE, event->keycode, count, engine_layer_states(&keyboard->engine), 0);
+
+    for (int i = 0; i < count; i++)
+        SendKey(screen, actions[i].keycode, actions[i].key_down);
+
+    return count ? 1 : -1;
 }
 
+static int release_keyboard(XWindowsScreen_t * screen, Keyboard_t * keyboard)
+{
+    Action_t actions[256];
+    int count = engine_release(&keyboard->engine, actions);
+
+    for (int a = 0; a < count; a++)
+        SendKey(screen, actions[a].keycode, actions[a].key_down);
 
-static int process_event(XWindowsScreen_t * screen)
+    return count;
+}
+
+int release_keys(XWindowsScreen_t * screen)
 {
-    XEvent ev;
-    Window current_window;
-    int revert;
+    int released = 0;
 
-    XNextEvent(screen->display, &ev);
+    screen->received = latency_now();
 
-    XGetInputFocus(screen->display, &current_window, &revert);
+    for (int i = 0; i < screen->nkeyboards; i++)
+        released += release_keyboard(screen, &screen->keyboards[i]);
 
-    if (ev.xcookie.type == GenericEvent &&
-//        ev.xcookie.extension == opcode &&
-        XGetEventData(screen->display, &ev.xcookie)) {
-        switch(ev.xcookie.evtype) {
-        case XI_KeyPress:
-            handle_key_press(screen, ev.xcookie.data);
+    FlushKeys(screen);
 
-            break;
-        case XI_KeyRelease:
-            handle_key_release(screen, ev.xcookie.data);
-            break;
-        default:
-            INFO("Unhandled Event Received of type %d\n", ev.xcookie.type);
-            break;
-        }
+    return released;
+}
 
-        XFreeEventData(screen->display, &ev.xcookie);
-    }
+int handle_key_release(XWindowsScreen_t * screen, KeyEvent_t *event)
+{
+    return handle_key(screen, event, false);
+}
 
-    return 0;
+int handle_key_press(XWindowsScreen_t * screen, KeyEvent_t *event)
+{
+    return handle_key(screen, event, true);
+}
+
+void handle_property_notify(XWindowsScreen_t * screen, Atom atom)
+{
+    if (atom == screen->NetActiveWindow)
+        update_focus(screen);
+}
+
+void handle_focus_in(XWindowsScreen_t * screen)
+{
+    update_focus(screen);
+}
+
+static void report_statistics(XWindowsScreen_t * screen)
+{
+    REPORT("%lu key events, %lu keys injected, %lu flushes (%.3f flushes per event)\n",
+           screen->events, statistic(&screen->injected), statistic(&screen->flushes),
+           screen->events ? (double)statistic(&screen->flushes) / screen->events : 0.0);
+
+    if (ReportLatency)
+        latency_report(stdout);
 }
 
 static int enumerate_keyboards(XWindowsScreen_t * screen)
@@ -499,10 +698,56 @@ static int enumerate_keyboards(XWindowsScreen_t * screen)
 }
 
 
-static int identify_local_keyboard(XWindowsScreen_t * screen)
+/* Does -i name keyboards, rather than list device IDs? */
+static inline bool selection_by_name(const char * selection)
+{
+    return strspn(selection, "0123456789, ") != strlen(selection);
+}
+
+/* Is this device one that -i asked for? */
+static bool device_selected(XIDeviceInfo * device, const char * selection)
+{
+    const char * p = selection;
+    char * end;
+
+    if (selection_by_name(selection))
+        /* A name pattern only ever matches keyboards */
+        return device->use == XISlaveKeyboard && strcasestr(device->name, selection) != 0;
+
+    while (*p) {
+        long id = strtol(p, &end, 10);
+
+        if (end == p)
+            p++;
+        else if (id == device->deviceid)
+            return true;
+        else
+            p = end;
+    }
+
+    return false;
+}
+
+/* Without -i we look for a single, real, keyboard */
+static bool device_is_local_keyboard(XIDeviceInfo * device)
 {
-    int keyboard_id = -1;
+    /* We're only interested in Keyboards */
+    if (device->use != XISlaveKeyboard)
+        return false;
 
+    /* We're only interested in keyboards which are presented as keyboards too! */
+    if (strcasestr(device->name, "keyboard") == 0 )
+        return false;
+
+    /* And I'm afraid we aren't going to deal with anything which isn't real... */
+    if (strcasestr(device->name, "virtual") != 0 )
+        return false;
+
+    return true;
+}
+
+static int identify_keyboards(XWindowsScreen_t * screen)
+{
     int ndevices;
     XIDeviceInfo *devices, *device;
 
@@ -510,75 +755,244 @@ static int identify_local_keyboard(XWindowsScreen_t * screen)
 
     for (int i = 0; i < ndevices; i++) {
         device = &devices[i];
-        
-        if (XInputDevice >= 0) {
-            if (device->deviceid != XInputDevice)
-                continue;
-        }
-        else {
-            /* We're only interested in Keyboards */
-            if (device->use != XISlaveKeyboard)
-                continue;
 
-            /* We're only interested in keyboards which are presented as keyboards too! */
-            if (strcasestr(device->name, "keyboard") == 0 )
+        if (XInputDevices) {
+            if (!device_selected(device, XInputDevices))
                 continue;
-
-            /* And I'm afraid we aren't going to deal with anything which isn't real... */
-            if (strcasestr(device->name, "virtual") != 0 )
-                continue;
-        }
+        } else if (!device_is_local_keyboard(device))
+            continue;
 
         /* However, If we have come this far, we likely have a keyboard! */
-        keyboard_id = device->deviceid;
-        printf("Using X Input Device = %d\n", keyboard_id);
-        screen->keyboard = *device; /* Copy the device structure for destruction */
-        break;
+        if (!add_keyboard(screen, device->deviceid, device->attachment, device->name))
+            break;
+
+        printf("Using X Input Device = %d (%s)\n", device->deviceid, device->name);
+
+        if (!XInputDevices)
+            break;
     }
 
     XIFreeDeviceInfo(devices);
 
-    return keyboard_id;
+    if (screen->nkeyboards == 0)
+        ERROR("No keyboard found%s%s\n", XInputDevices ? " matching " : "", XInputDevices ? XInputDevices : "");
+
+    return screen->nkeyboards;
+}
+
+/*
+ * A keyboard of ours has gone, unplugged or disabled over a suspend. Let
+ * go of whatever it was holding down, since its releases will never come,
+ * but keep the rest of its state for when it comes back.
+ */
+static void unplug_keyboard(XWindowsScreen_t * screen, Keyboard_t * keyboard)
+{
+    REPORT("Keyboard %s (id: %d) has gone\n", keyboard->name, keyboard->deviceid);
+    TRACE(HOTPLUG, keyboard->deviceid, 0, 0, 0);
+
+    screen->received = latency_now();
+    release_keyboard(screen, keyboard);
+
+    keyboard->deviceid = KEYBOARD_UNPLUGGED;
+}
+
+/*
+ * Is a device which has just appeared one of ours? Either a keyboard we
+ * have lost, known by its name since its ID may well have changed, or a
+ * new one which -i asks for by name.
+ */
+static Keyboard_t * replug_keyboard(XWindowsScreen_t * screen, XIDeviceInfo * device)
+{
+    Keyboard_t * keyboard = NULL;
+
+    if (device->use != XISlaveKeyboard && device->use != XIFloatingSlave)
+        return NULL;
+
+    for (int i = 0; i < screen->nkeyboards; i++)
+        if (screen->keyboards[i].deviceid == KEYBOARD_UNPLUGGED
+                && strcmp(screen->keyboards[i].name, device->name) == 0) {
+            keyboard = &screen->keyboards[i];
+            break;
+        }
+
+    if (keyboard) {
+        keyboard->deviceid = device->deviceid;
+        /* Still floating from before, it has nothing new to go back to */
+        if (device->use == XISlaveKeyboard)
+            keyboard->attachment = device->attachment;
+    } else if (XInputDevices && selection_by_name(XInputDevices)
+               && device_selected(device, XInputDevices)) {
+        keyboard = add_keyboard(screen, device->deviceid, device->attachment, device->name);
+    }
+
+    return keyboard;
+}
+
+void handle_hierarchy(XWindowsScreen_t * screen, int deviceid, int flags)
+{
+    Keyboard_t * keyboard = find_keyboard(screen, deviceid);
+    XIDeviceInfo * device;
+    int ndevices;
+
+    if (keyboard && (flags & (XIDeviceDisabled | XISlaveRemoved))) {
+        unplug_keyboard(screen, keyboard);
+        return;
+    }
+
+    /* Someone else has attached it again, perhaps a resume */
+    if (keyboard && (flags & XISlaveAttached)) {
+        INFO("Keyboard %s (id: %d) was attached again\n", keyboard->name, deviceid);
+        float_device(screen->display, deviceid);
+        return;
+    }
+
+    /* A new device is added disabled: it is only ready once enabled */
+    if (keyboard || !(flags & XIDeviceEnabled))
+        return;
+
+    device = XIQueryDevice(screen->display, deviceid, &ndevices);
+    if (!device)
+        return;
+
+    keyboard = replug_keyboard(screen, device);
+    if (keyboard) {
+        REPORT("Keyboard %s (id: %d) is back\n", keyboard->name, deviceid);
+        TRACE(HOTPLUG, deviceid, 1, 0, 0);
+        configure_keyboard(screen, keyboard);
+    }
+
+    XIFreeDeviceInfo(device);
+}
+
+/* The keys a keyboard has can change: follow the keymap it brings */
+void handle_device_changed(XWindowsScreen_t * screen, int deviceid)
+{
+    if (find_keyboard(screen, deviceid))
+        handle_keymap_notify(screen);
 }
 
 int xlib_halfkey(void)
 {
     XWindowsScreen_t * screen = construct();
 
-    if (screen->display == NULL) {
+    if (screen == NULL) {
         ERROR("Couldn't connect to XServer\n");
         return -1;
     }
 
-    /* Which version of XI2? We support 2.0 */
-    int major = 2, minor = 0;
+    /* Which version of XI2? We support 2.0, and take raw key events from 2.2 */
+    int major = 2, minor = 2;
     if (XIQueryVersion(screen->display, &major, &minor) == BadRequest) {
         printf("XI2 not available. Server supports %d.%d\n", major, minor);
         return -1;
     }
 
-    INFO("XI Version %d.%d\n", major, minor);
+    screen->xi_raw = RawEvents && (major > 2 || minor >= 2);
+
+    INFO("XI Version %d.%d, reading %s key events\n", major, minor, screen->xi_raw ? "raw" : "device");
 
     enumerate_keyboards(screen);
 
-    if (identify_local_keyboard(screen) < 0) {
+    if (identify_keyboards(screen) == 0) {
         destruct(screen);
         return -1;
     }
 
-    ConfigureKeyboard(screen);
+    ConfigureKeyboards(screen);
+
+    TrackFocus(screen);
+
+    if (keymap_open(screen) == 0)
+        report_mirror(config_current());
 
     fflush(stdout);
 
     DEBUG("Entering Event Loop...\n");
 
+    XFlush(screen->display);
+
+    if (Pipeline && start_pipeline(screen))
+        ERROR("Injecting from the event thread instead\n");
+
+    if (MetricsPath)
+        metrics_open(MetricsPath, screen);
+    if (ControlPath)
+        control_open(ControlPath, screen);
+
     // Loop until exit receiving and responding to events...
-    while (ApplicationRunning)
-        process_event(screen);
+    int result = -1;
+    if (screen->io->attach(screen) == 0)
+        result = loop_run();
+
+    control_close();
+    metrics_close();
+
+    stop_pipeline(screen);
+
+    report_statistics(screen);
 
     destruct(screen);
 
-    return 0;
+    return result;
+}
+
+/* The event loop for backends which need no X server */
+static int run_halfkey(XWindowsScreen_t * screen)
+{
+    fflush(stdout);
+
+    DEBUG("Entering Event Loop...\n");
+
+    if (Pipeline && start_pipeline(screen))
+        ERROR("Injecting from the event thread instead\n");
+
+    if (MetricsPath)
+        metrics_open(MetricsPath, screen);
+    if (ControlPath)
+        control_open(ControlPath, screen);
+
+    int result = -1;
+    if (screen->io->attach(screen) == 0)
+        result = loop_run();
+
+    control_close();
+    metrics_close();
+
+    stop_pipeline(screen);
+
+    report_statistics(screen);
+
+    screen->io->close(screen);
+    free_keyboards(screen);
+
+    return result;
+}
+
+/*
+ * Read the keyboard straight from evdev and inject through uinput, so that
+ * neither direction has to pass through an X server.
+ */
+int evdev_halfkey(const char * device)
+{
+    XWindowsScreen_t * screen = &LocalScreen;
+
+    if (evdev_io_open(screen, device)) {
+        ERROR("Couldn't open evdev device %s\n", device);
+        return -1;
+    }
+
+    return run_halfkey(screen);
+}
+
+/* Push a recording through the engine, with no display attached */
+int replay_halfkey(const char * path, bool paced, const char * output)
+{
+    XWindowsScreen_t * screen = &LocalScreen;
+
+    if (replay_io_open(screen, path, paced, output))
+        return -1;
+
+    return run_halfkey(screen);
 }
 
 #define BOLD "\033[1m"
@@ -598,133 +1012,680 @@ void usage(void)
 {
     printf("%s", BOLD);
     printf("\tusage:\n");
+    printf("\t\t-c read a configuration file, reloaded whenever it changes\n");
     printf("\t\t-m mirror mode - all keys reversed\n");
-    printf("\t\t-i select device, e.g. -i9 for id=9 \n");
+    printf("\t\t-i select devices by id or name, e.g. -i9,12,15 or -i \"usb keyboard\"\n");
+    printf("\t\t-e use an evdev device directly, e.g. -e /dev/input/event3\n");
+    printf("\t\t-l select keyboard layout:");
+    for (const struct xhk_layout * layout = xhk_layouts; layout->name; layout++)
+        printf(" %s", layout->name);
+    printf("\n");
+    printf("\t\t-r record the key events received to a file\n");
+    printf("\t\t-p replay a recording at full speed, with no display\n");
+    printf("\t\t-P replay a recording at its recorded timing\n");
+    printf("\t\t-o write the keys injected during replay to a file, or - for stdout\n");
     printf("\t\t-d increase debug verbosity levels\n");
-    printf("\t\t-t run internal tests\n");
+    printf("\t\t-s report latency statistics on exit, or on SIGUSR1\n");
+    printf("\t\t-t run internal tests, with -e through a uinput test keyboard\n");
     printf("\t\t-v report the version information\n");
+    printf("\t\t--realtime[=PRIO] run SCHED_FIFO at PRIO (default %d), with memory locked\n", REALTIME_DEFAULT_PRIORITY);
+    printf("\t\t--cpu=N pin the event loop to CPU N\n");
+    printf("\t\t--pipeline inject from a separate thread and X connection\n");
+    printf("\t\t--trace=FILE write a binary trace of each key to FILE on exit\n");
+    printf("\t\t--trace-mmap=FILE trace straight into FILE, which survives a crash\n");
+    printf("\t\t--tap[=MS] type space on a quick roll into a mirrored key, learning MS if not given\n");
+    printf("\t\t--metrics=PATH serve live counters in the Prometheus text format on a Unix socket\n");
+    printf("\t\t--control=PATH take commands to change modes on a Unix socket\n");
+    printf("\t\t--predict=DICT retype mirrored words as the likelier word in DICT, built by xhk-dictc\n");
+    printf("\t\t--no-raw read full XI2 key events, even from a server with raw ones\n");
+    printf("\t\t--jitter[=SECONDS] measure wakeup jitter under load, plain and realtime\n");
     printf("\t\t-h this help\n");
     printf("%s", NORMAL);
 }
 
-static void handle_signal(int signum)
+static int SignalFd = -1;
+
+/*
+ * Signals arrive through the event loop like any other event, so are
+ * handled in the event thread: the loop simply ends, and the keyboards
+ * are reattached on the way out, rather than from a signal handler.
+ */
+static void handle_signal(void * data)
+{
+    struct signalfd_siginfo info;
+
+    while (read(SignalFd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGUSR1:
+            latency_report(stdout);
+            break;
+        case SIGTERM: /* 15 */
+            ERROR("Received Signal %d\n", info.ssi_signo);
+            ERROR("Really want me to die huh?\n");
+            ApplicationRunning = false;
+            break;
+        default:
+            ERROR("Received Signal %d\n", info.ssi_signo);
+            ApplicationRunning = false;
+            break;
+        }
+    }
+}
+
+/*
+ * Must come before any thread is started, so that every thread inherits
+ * the blocked mask and the signals are left for the signalfd.
+ */
+int install_signal_handlers(void)
 {
-    ERROR("Received Signal %d\n", signum);
+    sigset_t mask;
 
-    switch (signum) {
-    case SIGTERM: /* 15 */
-        ERROR("Really want me to die huh?\n");
-        /* Fall Through */
-    default:
-        if (LocalScreen.display)
-            reattach_device(LocalScreen.display, LocalScreen.keyboard.deviceid, LocalScreen.keyboard.attachment);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
 
-        ApplicationRunning = false;
-        break;
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    SignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (SignalFd < 0) {
+        ERROR("Couldn't create a signalfd: %s\n", strerror(errno));
+        return -1;
     }
+
+    if (!loop_add_fd(SignalFd, handle_signal, NULL, NULL)) {
+        close(SignalFd);
+        SignalFd = -1;
+        return -1;
+    }
+
+    return 0;
 }
 
-void install_signal_handlers(void)
+static void remove_signal_handlers(void)
 {
-    signal(SIGTERM, handle_signal);
-    signal(SIGQUIT, handle_signal);
-    signal(SIGINT, handle_signal);
+    if (SignalFd >= 0)
+        close(SignalFd);
+    SignalFd = -1;
 }
 
-int KeycodeTest(XWindowsScreen_t * screen, int keycode, int up_flag, int expected, int expected_state)
+/* The time of the keys fed by KeycodeTest, in ms */
+static uint32_t TestTime;
+
+/*
+ * Feed one key to the engine, and check the last key it would inject
+ * (or -1 for none) and the SPACE state it is left in.
+ */
+int KeycodeTest(Engine_t * engine, int keycode, int up_flag, int expected, int expected_state)
 {
-    int returned_code = ProcessKeycode(screen, keycode, up_flag);
+    Action_t actions[ENGINE_MAX_ACTIONS];
+    int count = engine_process(engine, keycode, !up_flag, false, TestTime, actions);
+    int returned_code = count ? actions[count - 1].keycode : -1;
+    int errors = 0;
 
-    if (returned_code != expected)
-        ERROR("ProcessKeyCode for %d (%s) returned %d {%s} but expected %d {%s}\n", keycode, up_flag ? "Up" : "Down",
-              returned_code, keycode_to_char(screen, returned_code), expected, keycode_to_char(screen, expected));
+    if (returned_code != expected) {
+        ERROR("engine_process for %d (%s) returned %d but expected %d\n", keycode, up_flag ? "Up" : "Down",
+              returned_code, expected);
+        errors++;
+    }
 
-    if (space != expected_state)
-        ERROR("ProcessKeyCode for %d (%s %s) returned in state %d {%s} but expected state %d {%s}\n",
-              keycode, keycode_to_char(screen, keycode), up_flag ? "Up" : "Down",
-              space, SpaceStateNames[space], expected_state, SpaceStateNames[expected_state]);
+    if (engine->layers[0].space != expected_state) {
+        ERROR("engine_process for %d (%s) returned in state %d {%s} but expected state %d {%s}\n",
+              keycode, up_flag ? "Up" : "Down",
+              engine->layers[0].space, engine_state_name(engine->layers[0].space),
+              expected_state, engine_state_name(expected_state));
+        errors++;
+    }
 
-    return (returned_code != expected);
+    return errors;
 }
 
-#define UPFLAG_KEYDOWN 0
-#define UPFLAG_KEYUP 1
+/* Run one control command, and check whether it succeeded */
+static int ControlTest(const char * command, bool expected)
+{
+    char buf[64], reply[128];
 
-int xlib_test(void)
+    snprintf(buf, sizeof(buf), "%s", command);
+    if (control_command(&LocalScreen, buf, reply, sizeof(reply)) != expected) {
+        ERROR("control command '%s' replied '%s'\n", command, reply);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Unplug a keyboard in the middle of a hold, and plug it in again */
+static int HotplugTest(void)
 {
+    static XWindowsScreen_t screen;
+    XIDeviceInfo device = {
+        .deviceid = 12, .name = "Test keyboard", .use = XISlaveKeyboard, .attachment = 3,
+    };
+    Keyboard_t * keyboard = add_keyboard(&screen, 9, 3, device.name);
+    Action_t actions[ENGINE_MAX_ACTIONS];
+    unsigned long mirrored;
     int errors = 0;
 
-    XWindowsScreen_t * screen = construct();
+    engine_process(&keyboard->engine, KEY_SPACE, true, false, 1000, actions);
+    engine_process(&keyboard->engine, KEY_F, true, false, 1300, actions);
+    mirrored = keyboard->engine.stats.mirrored;
 
-    if (screen->display == NULL) {
-        ERROR("Couldn't connect to XServer\n");
-        return -1;
+    handle_hierarchy(&screen, 9, XIDeviceDisabled | XISlaveRemoved);
+    if (keyboard->deviceid != KEYBOARD_UNPLUGGED || screen.inject_count != 1
+            || screen.inject[0].keycode != KEY_J || screen.inject[0].key_down) {
+        ERROR("Unplugging didn't release J alone\n");
+        errors++;
     }
 
-    /* Which version of XI2? We support 2.0 */
-    int major = 2, minor = 0;
-    if (XIQueryVersion(screen->display, &major, &minor) == BadRequest) {
-        printf("XI2 not available. Server supports %d.%d\n", major, minor);
-        return -1;
+    if (replug_keyboard(&screen, &device) != keyboard || keyboard->deviceid != 12
+            || keyboard->engine.stats.mirrored != mirrored || screen.nkeyboards != 1) {
+        ERROR("Plugging in again didn't find the keyboard, with its state, as device 12\n");
+        errors++;
     }
 
-    INFO("XI Version %d.%d\n", major, minor);
+    free_keyboards(&screen);
+    return errors;
+}
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
-    fflush(stdout);
+/*
+ * Record one keyboard holding space while another types F, then replay
+ * it. Only the F typed on the keyboard holding space is mirrored.
+ */
+static int ReplayTest(void)
+{
+    static const struct { int deviceid, keycode; bool key_down; } events[] = {
+        { 9, KEY_SPACE, true }, { 10, KEY_F, true }, { 10, KEY_F, false },
+        { 9, KEY_F, true }, { 9, KEY_F, false },
+    };
+    static XWindowsScreen_t screen;
+    char recording[] = "/tmp/xhk-recording-XXXXXX", output[] = "/tmp/xhk-output-XXXXXX";
+    char expected[64], replayed[64] = "";
+    int keyboards = 0;
+    int errors = 0;
+    FILE * fp;
+
+    if (close(mkstemp(recording)) || close(mkstemp(output)) || record_open(recording)) {
+        ERROR("Couldn't create files to replay through\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(events); i++) {
+        KeyEvent_t key = {
+            .deviceid = events[i].deviceid, .keycode = events[i].keycode, .time = 1000 + 100 * i,
+        };
+        record_event(&key, events[i].key_down);
+    }
+    record_close();
+
+    if (loop_init() || replay_io_open(&screen, recording, false, output) || screen.io->attach(&screen)) {
+        ERROR("Couldn't replay the recording\n");
+        errors++;
+    } else {
+        keyboards = screen.nkeyboards;
+        loop_run();
+        screen.io->close(&screen);
+    }
+    loop_close();
+    free_keyboards(&screen);
+    ApplicationRunning = true;
+
+    fp = fopen(output, "r");
+    if (fp) {
+        replayed[fread(replayed, 1, sizeof(replayed) - 1, fp)] = '\0';
+        fclose(fp);
+    }
+    unlink(recording);
+    unlink(output);
+
+    snprintf(expected, sizeof(expected), "%3d down\n%3d up\n%3d down\n%3d up\n", KEY_F, KEY_F, KEY_J, KEY_J);
+    if (keyboards != 2 || strcmp(replayed, expected)) {
+        ERROR("Replaying %d keyboards injected:\n%s", keyboards, replayed);
+        errors++;
+    }
+
+    return errors;
+}
+
+/* Load a configuration whose statements carry trailing comments */
+static int ConfigFileTest(void)
+{
+    static const char config[] =
+        "# comments on lines of their own\n"
+        "layout dvorak   # and after a statement\n"
+        "mirror on\t# tabs too\n"
+        "tap 120 #\n"
+        "devices Test keyboard  # a name with spaces\n";
+    char path[] = "/tmp/xhk-config-XXXXXX";
+    const EngineTable_t * table;
+    int fd = mkstemp(path);
+    int errors = 0;
+
+    if (fd < 0 || write(fd, config, sizeof(config) - 1) != sizeof(config) - 1 || close(fd)) {
+        ERROR("Couldn't write a configuration to load\n");
+        return 1;
+    }
+
+    if (config_open(path)) {
+        ERROR("Commented configuration didn't load\n");
+        errors++;
+    } else {
+        table = config_current();
+        if (!table->mirror_mode || table->tap_threshold != 120
+                || memcmp(table->layers[0].map, find_layout("dvorak")->mirror, 256)
+                || strcmp(config_devices(), "Test keyboard")) {
+            ERROR("Commented configuration loaded with the wrong settings\n");
+            errors++;
+        }
+    }
+
+    config_close();
+    unlink(path);
+    return errors;
+}
+
+/*
+ * Type F E T and a space, which "jet" should turn into J E T. Through a
+ * layer the letters are exactly as meant, and are left alone. A second
+ * keyboard typing in between has a word of its own.
+ */
+static int PredictTest(const EngineTable_t * table, bool mapped, bool interleaved, int expected, int first)
+{
+    static const char * const words[] = { "jet", "yet" };
+    static const uint32_t frequencies[] = { 100, 10 };
+    static const int keys[] = { KEY_F, KEY_E, KEY_T };
+    Action_t actions[PREDICT_MAX_ACTIONS];
+    PredictWord_t word = { .length = 0 }, other = { .length = 0 };
+    size_t size;
+    void * image = dict_build(words, frequencies, 2, &size);
+    int count = 0;
+    int errors = 0;
+
+    if (!image || predict_load(image, size)) {
+        ERROR("Couldn't build a dictionary\n");
+        free(image);
+        return 1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        actions[0] = (Action_t) { .keycode = keys[i], .key_down = true, .mapped = mapped };
+        actions[1] = (Action_t) { .keycode = keys[i], .key_down = false, .mapped = mapped };
+        predict_keys(&word, table, actions, 2);
+
+        if (interleaved) {
+            actions[0] = (Action_t) { .keycode = KEY_A, .key_down = true };
+            actions[1] = (Action_t) { .keycode = KEY_A, .key_down = false };
+            predict_keys(&other, table, actions, 2);
+        }
+    }
+
+    actions[0] = (Action_t) { .keycode = KEY_SPACE, .key_down = true };
+    count = predict_keys(&word, table, actions, 1);
+    if (count != expected || actions[count - 1].keycode != KEY_SPACE
+            || (count > 1 && (actions[0].keycode != KEY_BACKSPACE || actions[6].keycode != first))) {
+        ERROR("predict_keys typed %d keys ending %d, expected %d keys from %d\n",
+              count, actions[count - 1].keycode, expected, first);
+        errors++;
+    }
+
+    free(image);
+    return errors;
+}
+
+#define UPFLAG_KEYDOWN 0
+#define UPFLAG_KEYUP 1
+
+/* The tests are written against the en_GB layout, and need no display */
+int engine_test(void)
+{
+    Action_t actions[ENGINE_MAX_ACTIONS];
+    Action_t released[256];
+    const EngineTable_t * moved;
+    EngineLayer_t * layer;
+    EngineTable_t table;
+    Engine_t engine;
+    uint8_t remap[256];
+    int errors = 0;
+
+    engine_table_init(&table, xhk_layouts[0].mirror, false);
+    engine_init(&engine, &table);
 
     INFO("Entering Test Loop...\n");
 
     DEBUG("Check a key returns as expected\n");
-    errors += KeycodeTest(screen, KEY_0, UPFLAG_KEYDOWN, KEY_0, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_0, UPFLAG_KEYUP, KEY_0, SPACE_STATE_START);
-
+    errors += KeycodeTest(&engine, KEY_0, UPFLAG_KEYDOWN, KEY_0, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_0, UPFLAG_KEYUP, KEY_0, SPACE_STATE_START);
 
     DEBUG("\nCheck space works alone\n");
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
-    /* If we expect a space - it gets sent by the state machine, so we have to cancel it out */
-    SendKey(screen, KEY_SPACE, KEYSTATE_UP, CurrentTime);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
 
     DEBUG("\nVerify a key gets mirrored\n");
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
-    errors += KeycodeTest(screen, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
-    errors += KeycodeTest(screen, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
-    /* If we expect a space - it gets sent by the state machine, so we have to cancel it out */
-    SendKey(screen, KEY_SPACE, KEYSTATE_UP, CurrentTime);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
 
     DEBUG("\nVerify a non-mirrored key doesn't break the space bar\n");
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
-    errors += KeycodeTest(screen, KEY_LSHIFT, UPFLAG_KEYDOWN, KEY_LSHIFT, SPACE_STATE_PRESSED);
-    errors += KeycodeTest(screen, KEY_LSHIFT, UPFLAG_KEYUP, KEY_LSHIFT, SPACE_STATE_PRESSED);
-    errors += KeycodeTest(screen, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_LSHIFT, UPFLAG_KEYDOWN, KEY_LSHIFT, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_LSHIFT, UPFLAG_KEYUP, KEY_LSHIFT, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
 
     DEBUG("\nVerify pressing paired mirror keys sequentially still works\n");
-    errors += KeycodeTest(screen, KEY_F, UPFLAG_KEYDOWN, KEY_F, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_J, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_J, UPFLAG_KEYUP, KEY_J, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_F, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_J, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_J, UPFLAG_KEYUP, KEY_J, SPACE_STATE_START);
     /* Try the other way too */
-    errors += KeycodeTest(screen, KEY_R, UPFLAG_KEYDOWN, KEY_R, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_U, UPFLAG_KEYDOWN, KEY_U, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_U, UPFLAG_KEYUP, KEY_U, SPACE_STATE_START);
-    errors += KeycodeTest(screen, KEY_R, UPFLAG_KEYUP, KEY_R, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_R, UPFLAG_KEYDOWN, KEY_R, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_U, UPFLAG_KEYDOWN, KEY_U, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_U, UPFLAG_KEYUP, KEY_U, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_R, UPFLAG_KEYUP, KEY_R, SPACE_STATE_START);
+
+    DEBUG("\nVerify space repeats are swallowed\n");
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    if (engine_process(&engine, KEY_SPACE, true, true, TestTime, actions) != 0) {
+        ERROR("engine_process injected a repeated space\n");
+        errors++;
+    }
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
+
+    DEBUG("\nVerify mirrored key repeats are left to the injected keyboard\n");
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    if (engine_process(&engine, KEY_F, true, true, TestTime, actions) != 0) {
+        ERROR("engine_process injected a repeated key\n");
+        errors++;
+    }
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+
+    DEBUG("\nVerify a quick roll off space is a tap\n");
+    table.tap_threshold = 100;
+    TestTime = 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 30;
+    if (engine_process(&engine, KEY_F, true, false, TestTime, actions) != 3
+            || actions[0].keycode != KEY_SPACE || !actions[0].key_down
+            || actions[1].keycode != KEY_SPACE || actions[1].key_down
+            || actions[2].keycode != KEY_F || engine.layers[0].space != SPACE_STATE_TAPPED) {
+        ERROR("engine_process didn't tap space before a quick F\n");
+        errors++;
+    }
+    TestTime += 20;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
+
+    DEBUG("\nVerify a slow key after space is still mirrored\n");
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 150;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+
+    DEBUG("\nVerify the engine counts taps, holds and mirrored keys\n");
+    engine.stats = (EngineStats_t) { 0 };
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 150;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_G, UPFLAG_KEYDOWN, KEY_G, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_G, UPFLAG_KEYUP, KEY_G, SPACE_STATE_START);
+    if (engine.stats.taps != 1 || engine.stats.holds != 1 || engine.stats.mirrored != 1
+            || engine.stats.passthrough != 1 || engine.stats.inversions != 1) {
+        ERROR("Counted %lu taps, %lu holds, %lu mirrored, %lu passed through and %lu inverted,"
+              " expected one of each\n", engine.stats.taps, engine.stats.holds,
+              engine.stats.mirrored, engine.stats.passthrough, engine.stats.inversions);
+        errors++;
+    }
 
-    INFO("\nExiting Test Loop with %d errors...\n", errors);
+    DEBUG("\nVerify the tap threshold is learned from rolls and chords\n");
+    table.tap_threshold = ENGINE_TAP_DEFAULT;
+    table.tap_adaptive = true;
+    for (int i = 0; i < ENGINE_TAP_SAMPLES; i++) {
+        /* Rolls with an 80ms lead: too slow for the default threshold */
+        TestTime += 1000;
+        engine_process(&engine, KEY_SPACE, true, false, TestTime, actions);
+        engine_process(&engine, KEY_F, true, false, TestTime + 80, actions);
+        engine_process(&engine, KEY_SPACE, false, false, TestTime + 100, actions);
+        engine_process(&engine, KEY_F, false, false, TestTime + 120, actions);
+        /* Chords with a 200ms lead */
+        TestTime += 1000;
+        engine_process(&engine, KEY_SPACE, true, false, TestTime, actions);
+        engine_process(&engine, KEY_F, true, false, TestTime + 200, actions);
+        engine_process(&engine, KEY_F, false, false, TestTime + 250, actions);
+        engine_process(&engine, KEY_SPACE, false, false, TestTime + 300, actions);
+    }
+    if (engine_tap_threshold(&engine) <= 80 || engine_tap_threshold(&engine) > 200) {
+        ERROR("Learned a tap threshold of %u ms, expected within (80, 200]\n",
+              engine_tap_threshold(&engine));
+        errors++;
+    }
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 80;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_F, SPACE_STATE_TAPPED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
+
+    DEBUG("\nVerify a disabled engine finishes a hold, then passes keys through\n");
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 300;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    table.enabled = false;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, KEY_SPACE, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_F, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, KEY_SPACE, SPACE_STATE_START);
+    table.enabled = true;
+
+    DEBUG("\nVerify a release follows its press across a change of mode\n");
+    table.mirror_mode = true;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_START);
+    table.mirror_mode = false;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_START);
+    table.mirror_mode = true;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_START);
+    table.enabled = false;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_START);
+    table.enabled = true;
+    table.mirror_mode = false;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_F, SPACE_STATE_START);
+    table.mirror_mode = true;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_F, SPACE_STATE_START);
+    table.mirror_mode = false;
+    if (engine.keystates[KEY_F] != KEYSTATE_UP || engine.keystates[KEY_J] != KEYSTATE_UP) {
+        ERROR("A change of mode left F or J held down\n");
+        errors++;
+    }
+
+    DEBUG("\nVerify the cancel key goes unseen, down and up, under a held layer\n");
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_ESC, UPFLAG_KEYDOWN, -1, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_ESC, UPFLAG_KEYUP, -1, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+
+    DEBUG("\nVerify releasing every held key, and the releases which follow\n");
+    TestTime += 1000;
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    TestTime += 300;
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    if (engine_release(&engine, released) != 1 || released[0].keycode != KEY_J
+            || released[0].key_down || engine.layers[0].space != SPACE_STATE_START) {
+        ERROR("engine_release didn't release J alone\n");
+        errors++;
+    }
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+
+    DEBUG("\nVerify another modifier runs a layer of its own\n");
+    layer = engine_table_layer(&table, KEY_CAPS);
+    layer->map[KEY_H] = 113;	/* Left */
+    layer->map[KEY_F] = KEY_1;
+    table.tap_threshold = 0;
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYDOWN, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_H, UPFLAG_KEYDOWN, 113, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_H, UPFLAG_KEYUP, 113, SPACE_STATE_START);
+    if (engine.layers[1].space != SPACE_STATE_MODIFIED) {
+        ERROR("CapsLock layer in state %s, expected Modified\n", engine_state_name(engine.layers[1].space));
+        errors++;
+    }
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYDOWN, -1, SPACE_STATE_START);
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYUP, KEY_CAPS, SPACE_STATE_START);
+
+    DEBUG("\nVerify layers held together, the last pressed first\n");
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYDOWN, -1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_1, SPACE_STATE_PRESSED);
+    errors += KeycodeTest(&engine, KEY_D, UPFLAG_KEYDOWN, KEY_K, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_CAPS, UPFLAG_KEYUP, -1, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_1, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYDOWN, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_F, UPFLAG_KEYUP, KEY_J, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_D, UPFLAG_KEYUP, KEY_K, SPACE_STATE_MODIFIED);
+    errors += KeycodeTest(&engine, KEY_SPACE, UPFLAG_KEYUP, -1, SPACE_STATE_START);
+    table.nlayers = 1;
+    engine_table_compile(&table);
+
+    DEBUG("\nVerify control commands change the table in force\n");
+    errors += ControlTest("disable", true);
+    errors += ControlTest("mirror toggle", true);
+    errors += ControlTest("layout dvorak", true);
+    if (config_current()->enabled || !config_current()->mirror_mode
+            || memcmp(config_current()->layers[0].map, find_layout("dvorak")->mirror, 256)) {
+        ERROR("control commands didn't publish a disabled, mirrored dvorak table\n");
+        errors++;
+    }
+    errors += ControlTest("layout qwertz", false);
+    errors += ControlTest("mirror sideways", false);
+    errors += ControlTest("frobnicate", false);
+    errors += ControlTest("status", true);
+    errors += ControlTest("release", true);
+    errors += ControlTest("toggle", true);
+    errors += ControlTest("mirror off", true);
+    config_layout(xhk_layouts[0].mirror);
+    if (!config_current()->enabled || config_current()->mirror_mode) {
+        ERROR("control commands didn't restore the table\n");
+        errors++;
+    }
 
-    XCloseDisplay(screen->display);
+    DEBUG("\nVerify an unplugged keyboard lets go of its keys, and comes back\n");
+    errors += HotplugTest();
 
-    return 0;
+    DEBUG("\nVerify a replay keeps each recorded keyboard apart\n");
+    errors += ReplayTest();
+
+    DEBUG("\nVerify a word is typed again as the dictionary prefers it\n");
+    errors += PredictTest(&table, false, false, 13, KEY_J);
+    errors += PredictTest(&table, true, false, 1, KEY_F);
+    errors += PredictTest(&table, false, true, 13, KEY_J);
+    if (predict_corrections() != 2) {
+        ERROR("Counted %lu words corrected, expected 2\n", predict_corrections());
+        errors++;
+    }
+    predict_close();
+
+    DEBUG("\nVerify a layout follows its keys onto other keycodes\n");
+    for (int i = 0; i < 256; i++)
+        remap[i] = i;
+    remap[KEY_F] = 200;
+    remap[KEY_J] = 201;
+    remap[KEY_SPACE] = 202;
+    config_remap(remap);
+    moved = config_current();
+    if (moved->layers[0].map[200] != 201 || moved->layers[0].map[201] != 200
+            || moved->layers[0].map[KEY_F] != KEY_F || moved->layers[0].modifier != 202) {
+        ERROR("config_remap didn't move F, J and SPACE onto their new keycodes\n");
+        errors++;
+    }
+    config_remap(NULL);
+
+    DEBUG("\nVerify a configuration may comment any line\n");
+    errors += ConfigFileTest();
+
+    DEBUG("\nVerify the QWERTY, QWERTZ and AZERTY boards share the default table\n");
+    if (find_layout("en_GB")->mirror[KEY_BSLASH] != KEY_BSLASH
+            || find_layout("en_US")->mirror != xhk_layouts[0].mirror
+            || find_layout("de")->mirror != xhk_layouts[0].mirror
+            || find_layout("fr")->mirror != xhk_layouts[0].mirror) {
+        ERROR("Layout aliases don't share the default table, leaving BKSL alone\n");
+        errors++;
+    }
+
+    INFO("\nExiting Test Loop with %d errors...\n", errors);
+
+    return errors;
 }
 
 
+enum {
+    OPT_REALTIME = 256,
+    OPT_CPU,
+    OPT_JITTER,
+    OPT_PIPELINE,
+    OPT_TRACE,
+    OPT_TRACE_MMAP,
+    OPT_TAP,
+    OPT_METRICS,
+    OPT_CONTROL,
+    OPT_PREDICT,
+    OPT_NO_RAW,
+};
+
+#define TRACE_RECORDS (32 * 1024)	/* per thread */
+
+static const struct option LongOptions[] = {
+    { "realtime", optional_argument, NULL, OPT_REALTIME },
+    { "cpu",      required_argument, NULL, OPT_CPU },
+    { "jitter",   optional_argument, NULL, OPT_JITTER },
+    { "pipeline", no_argument,       NULL, OPT_PIPELINE },
+    { "trace",    required_argument, NULL, OPT_TRACE },
+    { "trace-mmap", required_argument, NULL, OPT_TRACE_MMAP },
+    { "tap",      optional_argument, NULL, OPT_TAP },
+    { "metrics",  required_argument, NULL, OPT_METRICS },
+    { "control",  required_argument, NULL, OPT_CONTROL },
+    { "predict",  required_argument, NULL, OPT_PREDICT },
+    { "no-raw",   no_argument,       NULL, OPT_NO_RAW },
+    { NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char **argv)
 {
-    char opt;
+    int opt;
+    bool test = false;
+    bool Realtime = false;
+    int RealtimePriority = REALTIME_DEFAULT_PRIORITY;
+    int RealtimeCPU = REALTIME_NO_CPU;
+    int JitterSeconds = 0;
+    const char * ConfigFile = NULL;
+    const char * PredictFile = NULL;
+    const char * TraceFile = NULL;
+    bool TraceMapped = false;
+    const char * EvdevDevice = NULL;
+    const char * RecordFile = NULL;
+    const char * ReplayFile = NULL;
+    const char * ReplayOutput = NULL;
+    bool ReplayPaced = false;
+    int TapThreshold = 0;
+    bool TapAdaptive = false;
 
     REPORT("\n-- HalfKey Xorg Driver Utility %s --\n", VERSION);
 
-    while((opt = getopt(argc, argv, "dvhmti:")) != -1)
+    while((opt = getopt_long(argc, argv, "dvhmsti:l:e:r:p:P:o:c:", LongOptions, NULL)) != -1)
         switch(opt) {
         case 'd':
             verbose++;
@@ -738,20 +1699,96 @@ int main(int argc, char **argv)
         case 'm':
             MirrorMode = true;
             break;
+        case 's':
+            ReportLatency = true;
+            break;
         case 't':
-            xlib_test();
-            exit(0);
+            test = true;
+            break;
+        case 'c':
+            ConfigFile = optarg;
+            break;
+        case 'e':
+            EvdevDevice = optarg;
+            break;
+        case 'r':
+            RecordFile = optarg;
+            break;
+        case 'P':
+            ReplayPaced = true;
+            /* Fall Through */
+        case 'p':
+            ReplayFile = optarg;
+            break;
+        case 'o':
+            ReplayOutput = optarg;
             break;
         case 'i':
-            XInputDevice = atoi(optarg);
-            printf("XInputDevice = %d\n",XInputDevice);
+            XInputDevices = optarg;
+            printf("XInputDevices = %s\n", XInputDevices);
+            break;
+        case 'l':
+            Layout = find_layout(optarg);
+            if (!Layout) {
+                ERROR("Unknown layout '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_REALTIME:
+            Realtime = true;
+            if (optarg)
+                RealtimePriority = atoi(optarg);
+            break;
+        case OPT_CPU:
+            RealtimeCPU = atoi(optarg);
+            break;
+        case OPT_TRACE_MMAP:
+            TraceMapped = true;
+            /* Fall Through */
+        case OPT_TRACE:
+            TraceFile = optarg;
+            break;
+        case OPT_PIPELINE:
+            Pipeline = true;
+            break;
+        case OPT_JITTER:
+            JitterSeconds = optarg ? atoi(optarg) : 10;
+            break;
+        case OPT_TAP:
+            TapAdaptive = !optarg;
+            TapThreshold = optarg ? atoi(optarg) : ENGINE_TAP_DEFAULT;
+            break;
+        case OPT_METRICS:
+            MetricsPath = optarg;
+            break;
+        case OPT_CONTROL:
+            ControlPath = optarg;
+            break;
+        case OPT_PREDICT:
+            PredictFile = optarg;
+            break;
+        case OPT_NO_RAW:
+            RawEvents = false;
             break;
         default:
             usage();
             exit(1);
         }
 
-    install_signal_handlers();
+    config_init(Layout->mirror, MirrorMode);
+    config_tap(TapThreshold, TapAdaptive);
+
+    if (test) {
+        if (EvdevDevice)
+            exit(evdev_test() ? 1 : 0);
+
+        exit(engine_test() ? 1 : 0);
+    }
+
+    /* The injector thread has a display connection of its own */
+    if (Pipeline)
+        XInitThreads();
 
     int ret = setpriority(PRIO_PROCESS, getpid(), -20);
     if (ret)
@@ -759,11 +1796,53 @@ int main(int argc, char **argv)
 
     INFO("Process Priority set at %d\n", getpriority(PRIO_PROCESS, getpid()));
 
-    xlib_halfkey();
+    if (JitterSeconds)
+        exit(realtime_jitter(JitterSeconds, RealtimePriority, RealtimeCPU) ? 1 : 0);
+
+    if (loop_init() || install_signal_handlers())
+        exit(1);
 
+    if (Realtime && realtime_setup(RealtimePriority, RealtimeCPU))
+        ERROR("Not all real time steps succeeded, continuing anyway\n");
+
+    INFO("Using %s keyboard layout\n", Layout->name);
+
+    /* Before any thread starts, since each attaches to its ring as it does */
+    if (TraceFile && trace_open(TraceFile, TRACE_RECORDS, TraceMapped))
+        exit(1);
+
+    if (ConfigFile) {
+        if (config_open(ConfigFile))
+            exit(1);
+
+        if (!XInputDevices)
+            XInputDevices = config_devices();
+    }
+
+    if (PredictFile && predict_open(PredictFile))
+        exit(1);
+
+    if (RecordFile && record_open(RecordFile))
+        exit(1);
+
+    int result;
+    if (ReplayFile)
+        result = replay_halfkey(ReplayFile, ReplayPaced, ReplayOutput);
+    else if (EvdevDevice)
+        result = evdev_halfkey(EvdevDevice);
+    else
+        result = xlib_halfkey();
+
+    record_close();
+    predict_close();
+    config_close();
+    trace_close();
+
+    loop_close();
+    remove_signal_handlers();
 
     REPORT("\n-- Terminating --\n");
 
-    return 0;
+    return result ? 1 : 0;
 }
 
@@ -0,0 +1,225 @@
+/*
+    XHalfKey. An Xorg/XLib HalfKeyboard interpreter driver.
+
+    Copyright (C) 2014  Kieran Bingham
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef XHK_H_
+#define XHK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+
+#include "xhk-engine.h"
+#include "xhk-predict.h"
+
+extern int verbose;
+
+#define PRINT(level, x ...) 	if (verbose >= level) printf(x)
+#define ERROR(...) 		PRINT(0, 	 ##__VA_ARGS__)
+#define REPORT(...) 		PRINT(1, 	 ##__VA_ARGS__)
+#define INFO(...) 		PRINT(2, 	 ##__VA_ARGS__)
+#define DEBUG(...) 		PRINT(3, 	 ##__VA_ARGS__)
+#define VERBOSE(level, ...) 	PRINT(level, ##__VA_ARGS__)
+
+extern bool ApplicationRunning;
+
+#define INJECT_QUEUE_SIZE 128	/* a whole word typed again, in predictive mode */
+#define MAX_KEYBOARDS 16
+
+struct xhk_io;
+
+/* A fake key event waiting to be injected */
+typedef struct Injection_s {
+    uint8_t  keycode;
+    bool     key_down;
+    uint64_t received;	/* when the causing event was read */
+    uint64_t queued;
+} Injection_t;
+
+/* X never numbers a device below zero */
+#define KEYBOARD_UNPLUGGED -1
+
+/*
+ * A keyboard we have taken over, each with a state machine of its own.
+ * Everything here is our own copy, and outlives the device itself, which
+ * may be unplugged and come back under another device ID.
+ */
+typedef struct Keyboard_s {
+    int deviceid;		/* 0 when not an X device, or KEYBOARD_UNPLUGGED */
+    int attachment;		/* master to reattach to on exit */
+    bool autorepeat;		/* server autorepeat to restore on exit */
+    char * name;
+
+    Engine_t engine;
+    PredictWord_t word;		/* --predict: the word being typed */
+} Keyboard_t;
+
+typedef struct XWindowsScreen_s {
+    Display* display;
+
+    int nkeyboards;
+    Keyboard_t keyboards[MAX_KEYBOARDS];
+
+    XKeyboardState   KBState;
+    XKeyboardControl KBControl;
+
+    /* Event input and key injection, over X or evdev */
+    const struct xhk_io * io;
+
+    /*
+     * Focus cache: maintained from PropertyNotify/FocusIn events so that
+     * the key handling path never has to make a round trip to find it.
+     */
+    Atom   NetActiveWindow;
+    bool   ewmh_focus;
+    Window focus;
+
+    /* Keys are selected as XI 2.2 raw events, rather than device events */
+    bool xi_raw;
+
+    /* XKB's event code, for keymap changes (xhk-keymap.c); 0 when unused */
+    int xkb_event;
+
+    /*
+     * Injection queue: fake key events generated while a batch of input
+     * events is processed are written to the server with a single flush.
+     */
+    int inject_count;
+    Injection_t inject[INJECT_QUEUE_SIZE];
+
+    /* Injection is handed to a thread of its own (xhk-pipeline.c) */
+    bool pipelined;
+
+    /* When the event being processed was read, for latency tracing */
+    uint64_t received;
+
+    /*
+     * Statistics. An injector screen counts on its own thread while the
+     * metrics are read from the event thread, so injection is counted
+     * atomically, though with only the one writer never needs a locked
+     * instruction to do so.
+     */
+    unsigned long events;
+    atomic_ulong injected;
+    atomic_ulong flushes;
+    atomic_ulong requests;	/* X requests sent, as of the last flush */
+    uint32_t sequence;		/* X request sequence number they were counted to */
+} XWindowsScreen_t;
+
+static inline void statistic_add(atomic_ulong * statistic, unsigned long n)
+{
+    atomic_store_explicit(statistic, atomic_load_explicit(statistic, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/*
+ * Count the X requests sent since the last sequence number seen. Only the
+ * low 32 bits are compared, which is all XCB hands out, so the count runs
+ * on through the sequence number wrapping.
+ */
+static inline void statistic_requests(XWindowsScreen_t * screen, uint32_t sequence)
+{
+    statistic_add(&screen->requests, (uint32_t)(sequence - screen->sequence));
+    screen->sequence = sequence;
+}
+
+static inline unsigned long statistic(atomic_ulong * statistic)
+{
+    return atomic_load_explicit(statistic, memory_order_relaxed);
+}
+
+/* A key event from the floated keyboard, independent of the X binding */
+typedef struct KeyEvent_s {
+    int deviceid;
+    int keycode;
+    bool repeat;
+    unsigned long time;		/* device timestamp, milliseconds */
+    uint64_t received;		/* latency_now() when xhk read the event */
+} KeyEvent_t;
+
+/* xhk.c: event handlers called by the event I/O implementation */
+int handle_key_press(XWindowsScreen_t * screen, KeyEvent_t * event);
+int handle_key_release(XWindowsScreen_t * screen, KeyEvent_t * event);
+void handle_property_notify(XWindowsScreen_t * screen, Atom atom);
+void handle_focus_in(XWindowsScreen_t * screen);
+/* XI2 hierarchy flags (XISlaveAdded...) for one device, and device changes */
+void handle_hierarchy(XWindowsScreen_t * screen, int deviceid, int flags);
+void handle_device_changed(XWindowsScreen_t * screen, int deviceid);
+/* xhk-keymap.c: the keymap has changed */
+void handle_keymap_notify(XWindowsScreen_t * screen);
+int FlushKeys(XWindowsScreen_t * screen);
+/* Inject a release of every key held down by xhk, returning how many */
+int release_keys(XWindowsScreen_t * screen);
+const struct xhk_layout * find_layout(const char * name);
+/* Remove a Unix socket left at path, but never anything else there */
+int unlink_socket(const char * path);
+Keyboard_t * add_keyboard(XWindowsScreen_t * screen, int deviceid, int attachment, const char * name);
+void free_keyboards(XWindowsScreen_t * screen);
+
+/*
+ * Event I/O: reading key events and injecting keys. This is the hot path.
+ * Keycodes are always X keycodes, whatever the underlying device.
+ */
+struct xhk_io {
+    const char * name;
+    /* Event times are CLOCK_MONOTONIC milliseconds, as latency_now_ms() */
+    bool monotonic_time;
+    /*
+     * Add the event source to the event loop (xhk-loop.c), which then
+     * dispatches every event available whenever it is ready, followed
+     * by a FlushKeys(). Removed again by close().
+     */
+    int (*attach)(XWindowsScreen_t * screen);
+    int (*fake_key)(XWindowsScreen_t * screen, int keycode, bool key_down);
+    void (*flush)(XWindowsScreen_t * screen);
+    void (*close)(XWindowsScreen_t * screen);
+};
+
+/*
+ * The X connection, implemented either on Xlib (xhk-io-xlib.c) or natively
+ * on XCB (xhk-io-xcb.c), as chosen at configure time.
+ */
+int x11_io_open(XWindowsScreen_t * screen);
+
+/* Linux evdev input and uinput output, bypassing the X server (xhk-evdev.c) */
+int evdev_io_open(XWindowsScreen_t * screen, const char * device);
+int evdev_test(void);
+
+/* Recording and replay of key event streams (xhk-replay.c) */
+int record_open(const char * path);
+void record_event(KeyEvent_t * event, bool key_down);
+void record_close(void);
+int replay_io_open(XWindowsScreen_t * screen, const char * path, bool paced, const char * output);
+
+/*
+ * Pipelined injection (xhk-pipeline.c): FlushKeys() on a pipelined screen
+ * passes its queue through a ring to a thread which injects through the
+ * injector screen, so that a slow server never holds up reading events.
+ */
+int pipeline_start(XWindowsScreen_t * screen, XWindowsScreen_t * injector);
+void pipeline_push(XWindowsScreen_t * screen);
+void pipeline_stop(XWindowsScreen_t * screen);
+/* The injector's screen, while the pipeline is running */
+XWindowsScreen_t * pipeline_injector(XWindowsScreen_t * screen);
+
+#endif /* XHK_H_ */